@@ -30,3 +30,17 @@ enum CertificatePurpose {
     Signing = 1 << 2
 };
 
+enum HashAlgorithm {
+    UnknownHash, // guessed from the length
+    Sha1Hash,
+    Sha224Hash,
+    Sha256Hash,
+    Sha384Hash,
+    Sha512Hash
+};
+
+enum KeyType {
+    RsaKey,
+    EcKey
+};
+
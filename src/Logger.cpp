@@ -17,30 +17,87 @@
  */
 
 #include "Logger.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
 #ifndef _WIN32
 #include <unistd.h>
 #include <pthread.h>
-#include <iostream>
+#include <sys/uio.h>
 #else
-#include <time.h>
+#include <io.h>
 #endif
 
 using namespace std;
 
-static void printCurrentDateTime(FILE *log) {
-    time_t now = time(0);
-    tm *ltm = localtime(&now);
-    //Date format yyyy-MM-dd hh:mm:ss
-    fprintf(log, "%i-%.2i-%.2i %.2i:%.2i:%.2i ",
-            1900 + ltm->tm_year,
-            ltm->tm_mon + 1,
-            ltm->tm_mday,
-            ltm->tm_hour,
-            ltm->tm_min,
-            ltm->tm_sec);
-}
+// Lines are formatted by the calling thread and handed over to a single
+// flusher thread through a bounded lock-free queue. The flusher keeps the
+// log file open and writes out whatever has accumulated with one writev().
+// A producer never waits: if the queue is full, the line is dropped and
+// counted, and the count is written to the log once there is room again.
+
+static const size_t QUEUE_SIZE = 1024; // must be a power of two
+static const size_t BATCH_SIZE = 64;
+
+// Bounded multi-producer queue (Dmitry Vyukov's algorithm), single consumer
+class LogQueue {
+public:
+    LogQueue() {
+        for (size_t i = 0; i < QUEUE_SIZE; i++)
+            cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    bool push(string &line) {
+        Cell *cell;
+        size_t pos = head.load(memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & (QUEUE_SIZE - 1)];
+            size_t seq = cell->sequence.load(memory_order_acquire);
+            if (seq == pos) {
+                if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            } else if (seq < pos) {
+                return false; // full
+            } else {
+                pos = head.load(memory_order_relaxed);
+            }
+        }
+        cell->line.swap(line);
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    // Single consumer: the flusher, or shutdown after it is joined
+    bool pop(string &line) {
+        Cell &cell = cells[tail & (QUEUE_SIZE - 1)];
+        if (cell.sequence.load(memory_order_acquire) != tail + 1)
+            return false;
+        line.swap(cell.line);
+        cell.line.clear();
+        cell.sequence.store(tail + QUEUE_SIZE, memory_order_release);
+        tail++;
+        return true;
+    }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        string line;
+    };
+    Cell cells[QUEUE_SIZE];
+    atomic<size_t> head{0};
+    size_t tail = 0;
+};
 
 static string getLogFilePath() {
 #ifdef _WIN32
@@ -50,32 +107,262 @@ static string getLogFilePath() {
 #endif
 }
 
-static bool logFileExist() {
-    FILE *file = fopen(getLogFilePath().c_str(), "r");
-    if (!file) {
-        return false;
+class LogWriter {
+public:
+    // Logging is enabled by creating the log file. This is checked once,
+    // at startup.
+    LogWriter() {
+#ifdef _WIN32
+        fd = _open(getLogFilePath().c_str(), _O_WRONLY | _O_APPEND | _O_BINARY);
+#else
+        fd = open(getLogFilePath().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+#endif
+        if (fd != -1)
+            flusher = thread(&LogWriter::run, this);
+    }
+
+    bool enabled() const {
+        return fd != -1;
+    }
+
+    void push(string &line) {
+        // Shutdown waits for the pushes that did not see it coming
+        pushing.fetch_add(1);
+        if (stopped.load()) {
+            pushing.fetch_sub(1);
+            // Logging from static destructors, after the flusher is gone
+            lock_guard<mutex> lock(mtx);
+            writeAll(&line, 1);
+            return;
+        }
+        if (!queue.push(line))
+            dropped.fetch_add(1, memory_order_relaxed);
+        pushing.fetch_sub(1);
+        if (sleeping.load(memory_order_acquire))
+            wakeup.notify_one();
+    }
+
+    // Writes out everything that is queued and stops the flusher
+    void shutdown() {
+        if (!flusher.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(mtx);
+            stopped.store(true);
+            stop = true;
+        }
+        wakeup.notify_one();
+        flusher.join();
+        while (pushing.load() != 0)
+            this_thread::yield();
+        // Lines queued while the flusher was on its way out
+        vector<string> batch(BATCH_SIZE);
+        lock_guard<mutex> lock(mtx);
+        while (writeQueued(batch)) {}
+    }
+
+private:
+    // Writes out a batch of queued lines, false if there was nothing
+    bool writeQueued(vector<string> &batch) {
+        size_t count = 0;
+        unsigned long lost = dropped.exchange(0, memory_order_relaxed);
+        if (lost) {
+            batch[count++] = "[" + to_string(lost) + " log lines dropped]\n";
+        }
+        while (count < BATCH_SIZE && queue.pop(batch[count]))
+            count++;
+        if (count)
+            writeAll(batch.data(), count);
+        return count != 0;
     }
-    fclose(file);
-    return true;
+
+    void run() {
+        vector<string> batch(BATCH_SIZE);
+        unique_lock<mutex> lock(mtx);
+        for (;;) {
+            if (writeQueued(batch))
+                continue;
+            if (stop)
+                break;
+            sleeping.store(true, memory_order_release);
+            // The timeout covers a producer that pushed just before we went to sleep
+            wakeup.wait_for(lock, chrono::milliseconds(100));
+            sleeping.store(false, memory_order_release);
+        }
+    }
+
+    void writeAll(string *lines, size_t count) {
+#ifdef _WIN32
+        for (size_t i = 0; i < count; i++)
+            _write(fd, lines[i].data(), unsigned(lines[i].size()));
+#else
+        struct iovec iov[BATCH_SIZE];
+        for (size_t i = 0; i < count; i++) {
+            iov[i].iov_base = &lines[i][0];
+            iov[i].iov_len = lines[i].size();
+        }
+        struct iovec *v = iov;
+        int n = int(count);
+        while (n > 0) {
+            ssize_t written = writev(fd, v, n);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            // Skip over what was written, in case of a short write
+            while (n > 0 && size_t(written) >= v->iov_len) {
+                written -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n > 0) {
+                v->iov_base = (char *)v->iov_base + written;
+                v->iov_len -= written;
+            }
+        }
+#endif
+        for (size_t i = 0; i < count; i++)
+            lines[i].clear();
+    }
+
+    int fd = -1;
+    LogQueue queue;
+    thread flusher;
+    mutex mtx; // protects stop and the file after shutdown
+    condition_variable wakeup;
+    bool stop = false;
+    atomic<bool> sleeping{false};
+    atomic<bool> stopped{false};
+    atomic<int> pushing{0};
+    atomic<unsigned long> dropped{0};
+};
+
+static atomic<LogWriter *> active{nullptr};
+
+// Never destroyed, so that logging from static destructors stays safe
+static LogWriter *writer() {
+    static LogWriter *instance = new LogWriter();
+    active.store(instance, memory_order_release);
+    return instance;
 }
 
-void Logger::writeLog(const char *functionName, const char *fileName, int lineNumber, const char *message, ...) {
-    if (!logFileExist()) {
+// Flushes the log when the process exits normally
+static struct LogFlushOnExit {
+    ~LogFlushOnExit() {
+        if (LogWriter *log = active.load(memory_order_acquire))
+            log->shutdown();
+    }
+} flushOnExit;
+
+// WEB_EID_LOG_LEVEL (error, warning, info, debug or trace) and
+// WEB_EID_LOG_CATEGORIES (comma separated general, pcsc, p11, host, ui)
+// narrow down what is logged. Everything is logged by default.
+static int initialLevel() {
+    if (!writer()->enabled())
+        return 0;
+    static const char *names[] = {"error", "warning", "info", "debug", "trace"};
+    const char *env = getenv("WEB_EID_LOG_LEVEL");
+    for (int i = 0; env && i < 5; i++) {
+        if (strcmp(env, names[i]) == 0)
+            return Logger::Error + i;
+    }
+    return Logger::Trace;
+}
+
+static unsigned initialCategories() {
+    static const char *names[] = {"general", "pcsc", "p11", "host", "ui"};
+    const char *env = getenv("WEB_EID_LOG_CATEGORIES");
+    if (!env)
+        return ~0u;
+    unsigned mask = 0;
+    string list = string(env) + ",";
+    for (size_t start = 0, end; (end = list.find(',', start)) != string::npos; start = end + 1) {
+        string name = list.substr(start, end - start);
+        for (int i = 0; i < 5; i++) {
+            if (name == names[i])
+                mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+// Constant initialized, so that logging from other static initializers
+// does not depend on the order of translation units
+atomic<int> Logger::level{-1};
+atomic<unsigned> Logger::categories{0};
+
+int Logger::initialize() {
+    static const int initial = [] {
+        categories.store(initialCategories(), memory_order_relaxed);
+        int result = initialLevel();
+        level.store(result, memory_order_release);
+        return result;
+    }();
+    return initial;
+}
+
+static void appendCurrentDateTime(string &line) {
+    time_t now = time(0);
+    tm ltm;
+#ifdef _WIN32
+    localtime_s(&ltm, &now);
+#else
+    localtime_r(&now, &ltm);
+#endif
+    //Date format yyyy-MM-dd hh:mm:ss
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%i-%.2i-%.2i %.2i:%.2i:%.2i ",
+             1900 + ltm.tm_year,
+             ltm.tm_mon + 1,
+             ltm.tm_mday,
+             ltm.tm_hour,
+             ltm.tm_min,
+             ltm.tm_sec);
+    line.append(buf);
+}
+
+static void appendFormat(string &line, const char *format, va_list args) {
+    char buf[512];
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(buf, sizeof(buf), format, copy);
+    va_end(copy);
+    if (len < 0)
+        return;
+    if (size_t(len) < sizeof(buf)) {
+        line.append(buf, size_t(len));
         return;
     }
-    FILE *log = fopen(getLogFilePath().c_str(), "a");
-    if (!log) {
+    size_t offset = line.size();
+    line.resize(offset + size_t(len) + 1);
+    vsnprintf(&line[offset], size_t(len) + 1, format, args);
+    line.resize(offset + size_t(len));
+}
+
+static void appendf(string &line, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    appendFormat(line, format, args);
+    va_end(args);
+}
+
+void Logger::writeLog(const char *functionName, const char *fileName, int lineNumber, const char *message, ...) {
+    LogWriter *log = writer();
+    if (!log->enabled()) {
         return;
     }
-    printCurrentDateTime(log);
+    string line;
+    line.reserve(256);
+    appendCurrentDateTime(line);
 #ifndef _WIN32
-    fprintf(log, "[%i %lu] ", getpid(), pthread_self());
+    appendf(line, "[%i %lu] ", getpid(), pthread_self());
 #endif
-    fprintf(log, "%s() [%s:%i] ", functionName, fileName, lineNumber);
+    appendf(line, "%s() [%s:%i] ", functionName, fileName, lineNumber);
     va_list args;
     va_start(args, message);
-    vfprintf(log, message, args);
+    appendFormat(line, message, args);
     va_end(args);
-    fprintf(log, "\n");
-    fclose(log);
+    line.push_back('\n');
+    log->push(line);
 }
@@ -18,14 +18,73 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdarg>
 
 namespace Logger {
+enum Level {
+    Error = 1,
+    Warning,
+    Info,
+    Debug,
+    Trace
+};
+
+enum Category {
+    General = 1 << 0,
+    PCSC = 1 << 1,
+    P11 = 1 << 2,
+    Host = 1 << 3,
+    UI = 1 << 4
+};
+
+// Highest enabled level (0 if logging is off, -1 until first use) and
+// the mask of enabled categories. Read from the environment by
+// initialize() the first time something is logged, see Logger.cpp
+extern std::atomic<int> level;
+extern std::atomic<unsigned> categories;
+int initialize();
+
+inline bool enabled(Level l, Category c) {
+    int current = level.load(std::memory_order_acquire);
+    if (current < 0)
+        current = initialize();
+    return l <= current && (categories.load(std::memory_order_relaxed) & c);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((format(printf, 4, 5)))
+#endif
 void writeLog(const char *functionName, const char *fileName, int lineNumber, const char *message, ...);
 }
 
+// Levels above this are compiled out, for example with LOG_MAX_LEVEL=3
+// only errors, warnings and info messages remain in the binary.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 5
+#endif
+
+#define LOG_ENABLED(LEVEL, CATEGORY) (LEVEL <= LOG_MAX_LEVEL && Logger::enabled(LEVEL, CATEGORY))
+
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
-#define _log(...) Logger::writeLog(__func__, __FILE__, __LINE__, __VA_ARGS__)
+#define LOG_FUNCTION __func__
 #else
-#define _log(...) Logger::writeLog(__FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
+#define LOG_FUNCTION __FUNCTION__
 #endif
+
+// Arguments are only evaluated if the level and category are enabled
+#define _log_at(LEVEL, CATEGORY, ...) do { \
+    if (LOG_ENABLED(LEVEL, CATEGORY)) \
+        Logger::writeLog(LOG_FUNCTION, __FILE__, __LINE__, __VA_ARGS__); \
+} while(0)
+
+#define _log(...) _log_at(Logger::Debug, Logger::General, __VA_ARGS__)
+#define _log_pcsc(...) _log_at(Logger::Debug, Logger::PCSC, __VA_ARGS__)
+#define _log_p11(...) _log_at(Logger::Debug, Logger::P11, __VA_ARGS__)
+#define _log_host(...) _log_at(Logger::Debug, Logger::Host, __VA_ARGS__)
+#define _log_ui(...) _log_at(Logger::Debug, Logger::UI, __VA_ARGS__)
+
+// Failures, kept in builds that compile out debug messages
+#define _log_error(CATEGORY, ...) _log_at(Logger::Error, Logger::CATEGORY, __VA_ARGS__)
+#define _log_warning(CATEGORY, ...) _log_at(Logger::Warning, Logger::CATEGORY, __VA_ARGS__)
+#define _log_info(CATEGORY, ...) _log_at(Logger::Info, Logger::CATEGORY, __VA_ARGS__)
@@ -0,0 +1,241 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "broker.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+// A freshly started broker is waited for this long
+static const int SPAWN_WAIT_MS = 2000;
+static const int SPAWN_POLL_MS = 20;
+
+bool Broker::enabled() {
+#ifdef _WIN32
+    return false;
+#else
+    static const bool enabled = [] {
+        const char *env = getenv("WEB_EID_BROKER");
+        return env && strcmp(env, "1") == 0;
+    }();
+    return enabled;
+#endif
+}
+
+int Broker::idleTimeout() {
+    const char *env = getenv("WEB_EID_BROKER_IDLE");
+    int seconds = env ? atoi(env) : 0;
+    return seconds > 0 ? seconds : 600;
+}
+
+#ifdef _WIN32
+
+std::string Broker::socketPath() { return std::string(); }
+int Broker::forward(const char *) { return -1; }
+bool Broker::lock() { return false; }
+bool Broker::trusted(long long) { return false; }
+int Broker::connect() { return -1; }
+bool Broker::spawn(const char *) { return false; }
+int Broker::relay(int) { return -1; }
+
+#else
+
+// The directory is created if needed and must belong to the user alone,
+// otherwise somebody else could stand in for the broker
+static std::string brokerDir() {
+    std::string dir;
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime)
+        dir = std::string(runtime) + "/web-eid";
+    else
+        dir = "/tmp/web-eid-" + std::to_string(getuid());
+    mkdir(dir.c_str(), 0700);
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        _log_host("Not using %s for the broker", dir.c_str());
+        return std::string();
+    }
+    return dir;
+}
+
+std::string Broker::socketPath() {
+    std::string dir = brokerDir();
+    return dir.empty() ? dir : dir + "/broker.sock";
+}
+
+bool Broker::lock() {
+    std::string dir = brokerDir();
+    if (dir.empty())
+        return false;
+    int fd = open((dir + "/broker.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return false;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return false;
+    }
+    // The file tells which process is the broker
+    std::string pid = std::to_string(getpid()) + "\n";
+    if (ftruncate(fd, 0) != 0 || write(fd, pid.data(), pid.size()) != ssize_t(pid.size()))
+        _log_warning(Host, "Could not write the broker PID");
+    // Deliberately leaked, the lock goes away with the process
+    return true;
+}
+
+bool Broker::trusted(long long fd) {
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(int(fd), SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0)
+        return false;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(int(fd), &uid, &gid) != 0)
+        return false;
+    return uid == getuid();
+#endif
+}
+
+int Broker::connect() {
+    std::string path = socketPath();
+    struct sockaddr_un addr;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Detached from the host, so that it lives on when the page is closed
+bool Broker::spawn(const char *self) {
+    std::string exe = self ? self : "";
+#ifdef __linux__
+    char buffer[4096];
+    ssize_t n = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
+    if (n > 0)
+        exe.assign(buffer, size_t(n));
+#endif
+    if (exe.empty())
+        return false;
+    _log_host("Starting broker %s", exe.c_str());
+    pid_t pid = fork();
+    if (pid == -1)
+        return false;
+    if (pid == 0) {
+        setsid();
+        if (fork() != 0)
+            _exit(0);
+        int null = open("/dev/null", O_RDWR);
+        if (null != -1) {
+            dup2(null, 0);
+            dup2(null, 1);
+        }
+        execl(exe.c_str(), exe.c_str(), "--broker", static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    return true;
+}
+
+static bool writeAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+// Frames are copied as they are in both directions, the broker sees
+// exactly what the browser sent
+int Broker::relay(int fd) {
+    struct pollfd fds[2] = {{0, POLLIN, 0}, {fd, POLLIN, 0}};
+    const int out[2] = {fd, 1};
+    char buffer[8192];
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (!fds[i].revents)
+                continue;
+            ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+            if (n < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            // Either the browser or the broker is done with the page. The
+            // broker only ends a page after a protocol error.
+            if (n <= 0 || !writeAll(out[i], buffer, size_t(n))) {
+                _log_host("Relay closed by the %s", i == 0 ? "browser" : "broker");
+                close(fd);
+                return i == 0 ? 0 : EXIT_FAILURE;
+            }
+        }
+    }
+    close(fd);
+    return EXIT_FAILURE;
+}
+
+int Broker::forward(const char *self) {
+    int fd = connect();
+    if (fd == -1 && spawn(self)) {
+        for (int waited = 0; fd == -1 && waited < SPAWN_WAIT_MS; waited += SPAWN_POLL_MS) {
+            usleep(SPAWN_POLL_MS * 1000);
+            fd = connect();
+        }
+    }
+    if (fd == -1) {
+        _log_host("Broker not available, serving the page here");
+        return -1;
+    }
+    _log_host("Forwarding to the broker");
+    return relay(fd);
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#pragma once
+
+#include <string>
+
+// Optional per-user daemon that keeps the PC/SC context, the loaded PKCS#11
+// modules and the certificate index across pages. A host started by the
+// browser only relays the native messaging frames between its stdio and
+// the broker, starting the broker if it is not running yet. Enabled with
+// WEB_EID_BROKER=1, not available on Windows.
+class Broker {
+public:
+    static bool enabled();
+    // Under a directory only the user can access, empty if there is none
+    static std::string socketPath();
+
+    // Host side. Returns the exit code once either end has closed, or -1
+    // if no broker could be reached and the request should be served here
+    static int forward(const char *self);
+
+    // Broker side. Only one broker runs at a time, the lock is held until
+    // the process exits and the lock file has its PID. False if another
+    // broker holds it.
+    static bool lock();
+    // True if the peer of the connected socket runs as the same user
+    static bool trusted(long long fd);
+    // Seconds the broker waits for a new page before exiting, WEB_EID_BROKER_IDLE
+    static int idleTimeout();
+
+private:
+    static int connect();
+    static bool spawn(const char *self);
+    static int relay(int fd);
+};
@@ -0,0 +1,167 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "cardprofile.h"
+#include "Logger.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cctype>
+
+static bool succeeded(const std::vector<unsigned char> &response) {
+    return response.size() >= 2 && response[response.size() - 2] == 0x90 && response.back() == 0x00;
+}
+
+// Sends a command APDU. A T=0 card that wants another Le says so with 6Cxx.
+static LONG send(PCSC &card, std::vector<unsigned char> apdu, std::vector<unsigned char> &response) {
+    for (int i = 0; i < 2; i++) {
+        response.resize(258);
+        LONG err = card.transmit(apdu, response);
+        if (err != SCARD_S_SUCCESS || response.size() != 2 || response[0] != 0x6C)
+            return err;
+        apdu.back() = response[1];
+    }
+    return SCARD_S_SUCCESS;
+}
+
+// Length of the DER object from its header, 0 if it is not a SEQUENCE
+static size_t derLength(const std::vector<unsigned char> &der) {
+    if (der.size() < 4 || der[0] != 0x30)
+        return 0;
+    if (der[1] < 0x80)
+        return 2 + der[1];
+    if (der[1] == 0x81)
+        return 3 + der[2];
+    if (der[1] == 0x82)
+        return 4 + (size_t(der[2]) << 8 | der[3]);
+    return 0;
+}
+
+// Reads the DER object in the selected transparent file. Files are often
+// bigger than what they hold, only as much as the DER header says is read.
+static LONG readDER(PCSC &card, std::vector<unsigned char> &der) {
+    static const size_t CHUNK = 0xE0;
+    std::vector<unsigned char> response;
+    size_t length = 0;
+    der.clear();
+    while (!length || der.size() < length) {
+        size_t wanted = length ? std::min(CHUNK, length - der.size()) : CHUNK;
+        LONG err = send(card, {0x00, 0xB0, (unsigned char)(der.size() >> 8), (unsigned char)der.size(), (unsigned char)wanted}, response);
+        if (err != SCARD_S_SUCCESS)
+            return err;
+        if (!succeeded(response) || response.size() == 2)
+            return SCARD_E_CARD_UNSUPPORTED;
+        der.insert(der.end(), response.begin(), response.end() - 2);
+        if (!length && !(length = derLength(der)))
+            return SCARD_E_INVALID_VALUE;
+    }
+    der.resize(length);
+    return SCARD_S_SUCCESS;
+}
+
+// Estonian ID-card up to EstEID 3.5. The authentication and signing
+// certificates are in the transparent files AACE and DDCE of DF EEEE.
+class EstEIDProfile: public CardProfile {
+public:
+    LONG readCertificates(PCSC &card, std::vector<std::vector<unsigned char>> &certs) const override {
+        std::vector<std::vector<unsigned char>> responses;
+        int mismatch;
+        // Select MF and DF EEEE, without asking for FCI
+        LONG err = card.transmit({{0x00, 0xA4, 0x00, 0x0C}, {0x00, 0xA4, 0x01, 0x0C, 0x02, 0xEE, 0xEE}}, {{0x90, 0x00}, {0x90, 0x00}}, true, responses, mismatch);
+        if (err != SCARD_S_SUCCESS)
+            return err;
+        if (mismatch >= 0 || responses.size() != 2)
+            return SCARD_E_CARD_UNSUPPORTED;
+        for (unsigned char file: {0xAA, 0xDD}) {
+            std::vector<unsigned char> response, der;
+            err = send(card, {0x00, 0xA4, 0x02, 0x0C, 0x02, file, 0xCE}, response);
+            if (err == SCARD_S_SUCCESS && !succeeded(response))
+                err = SCARD_E_CARD_UNSUPPORTED;
+            if (err == SCARD_S_SUCCESS)
+                err = readDER(card, der);
+            if (err != SCARD_S_SUCCESS)
+                return err;
+            certs.push_back(der);
+        }
+        return SCARD_S_SUCCESS;
+    }
+};
+
+// Profiles by ATR. The cards after EstEID 3.5 have the same name in the
+// table of P11Modules, but a different file system.
+const CardProfile *CardProfile::find(const std::vector<unsigned char> &atr) {
+    static const EstEIDProfile esteid;
+    static const struct {
+        const char *atr;
+        const CardProfile *profile;
+    } profiles[] = {
+        {"3BFE9400FF80B1FA451F034573744549442076657220312E3043", &esteid},
+        {"3BDE18FFC080B1FE451F034573744549442076657220312E302B", &esteid},
+        {"3B5E11FF4573744549442076657220312E30", &esteid},
+        {"3B6E00004573744549442076657220312E30", &esteid},
+        {"3BFE1800008031FE454573744549442076657220312E30A8", &esteid},
+        {"3BFE1800008031FE45803180664090A4561B168301900086", &esteid},
+        {"3BFE1800008031FE45803180664090A4162A0083019000E1", &esteid},
+        {"3BFE1800008031FE45803180664090A4162A00830F9000EF", &esteid},
+        {"3BF9180000C00A31FE4553462D3443432D303181", &esteid},
+        {"3BF81300008131FE454A434F5076323431B7", &esteid},
+    };
+    std::string hex = toHex(atr);
+    std::transform(hex.begin(), hex.end(), hex.begin(), ::toupper);
+    for (const auto &entry: profiles) {
+        if (hex == entry.atr)
+            return entry.profile;
+    }
+    return nullptr;
+}
+
+std::vector<std::shared_ptr<const CertificateInfo>> CardProfile::readAll(const std::vector<PCSCReader> &readers, std::vector<std::vector<unsigned char>> &rest) {
+    std::vector<std::shared_ptr<const CertificateInfo>> result;
+    for (const PCSCReader &reader: readers) {
+        if (reader.atr.empty())
+            continue;
+        const CardProfile *profile = find(reader.atr);
+        if (!profile) {
+            rest.push_back(reader.atr);
+            continue;
+        }
+        std::vector<std::vector<unsigned char>> certs;
+        LONG err;
+        {
+            // Shared and in a short transaction, this runs while pages may
+            // connect to the card. Left as it is when done, so that a login
+            // of a module stays valid.
+            PCSC card;
+            err = card.connectShared(reader.name);
+            if (err == SCARD_S_SUCCESS)
+                err = card.begin();
+            if (err == SCARD_S_SUCCESS)
+                err = profile->readCertificates(card, certs);
+            card.end();
+        }
+        if (err != SCARD_S_SUCCESS) {
+            _log_warning(PCSC, "Could not read certificates from %s, leaving it to modules: %s", reader.name.c_str(), PCSC::errorName(err));
+            rest.push_back(reader.atr);
+            continue;
+        }
+        _log_pcsc("Read %zu certificates from %s", certs.size(), reader.name.c_str());
+        for (const std::vector<unsigned char> &der: certs)
+            result.push_back(CertificateStore::add(der));
+    }
+    return result;
+}
@@ -0,0 +1,43 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "pcsc.h"
+#include "certificate.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Reads the certificates of a well known card with a few APDUs, which is
+// much faster than loading a PKCS#11 module and letting it parse the card.
+// Signing still goes through the module.
+class CardProfile {
+public:
+    virtual ~CardProfile() {}
+    // The card is connected. Certificates are appended in the order of the card.
+    virtual LONG readCertificates(PCSC &card, std::vector<std::vector<unsigned char>> &certs) const = 0;
+
+    // Null if the card is not known
+    static const CardProfile *find(const std::vector<unsigned char> &atr);
+
+    // Reads the certificates of all cards that have a profile. The ATR-s of
+    // the other cards, and of cards that could not be read, go to rest.
+    static std::vector<std::shared_ptr<const CertificateInfo>> readAll(const std::vector<PCSCReader> &readers, std::vector<std::vector<unsigned char>> &rest);
+};
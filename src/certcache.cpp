@@ -0,0 +1,408 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "certcache.h"
+#include "Logger.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char MAGIC[8] = {'W', 'E', 'B', 'E', 'I', 'D', 'C', 'C'};
+static const uint32_t FORMAT = 2; // of the file
+// Certificates may have been renewed on the same card, so tokens are
+// enumerated again after this many seconds
+static const int64_t MAX_AGE = 7 * 24 * 60 * 60;
+static const size_t MAX_TOKENS = 32;
+
+// The file is a header followed by a record for every token, most recent
+// first. Fields are in host byte order, the file does not leave the machine.
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count; // of records
+    uint64_t size; // of the records
+    uint64_t checksum; // FNV-1a of the records
+};
+
+static uint64_t checksum(const unsigned char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+class Writer {
+public:
+    std::string data;
+
+    void u32(uint32_t value) {
+        data.append((const char *)&value, sizeof(value));
+    }
+    void i64(int64_t value) {
+        data.append((const char *)&value, sizeof(value));
+    }
+    void bytes(const void *value, size_t size) {
+        u32(uint32_t(size));
+        data.append((const char *)value, size);
+    }
+    void blob(const std::vector<unsigned char> &value) {
+        bytes(value.data(), value.size());
+    }
+    void text(const std::string &value) {
+        bytes(value.data(), value.size());
+    }
+};
+
+// A read past the end clears ok, the values read are zero or empty then
+class Reader {
+public:
+    Reader(const unsigned char *data, size_t size): pos(data), end(data + size) {}
+    bool ok = true;
+
+    const unsigned char *take(size_t size) {
+        if (!ok || size_t(end - pos) < size) {
+            ok = false;
+            return nullptr;
+        }
+        const unsigned char *result = pos;
+        pos += size;
+        return result;
+    }
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (const unsigned char *data = take(sizeof(value)))
+            memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    int64_t i64() {
+        int64_t value = 0;
+        if (const unsigned char *data = take(sizeof(value)))
+            memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    std::vector<unsigned char> blob() {
+        uint32_t size = u32();
+        const unsigned char *data = take(size);
+        return data ? std::vector<unsigned char>(data, data + size) : std::vector<unsigned char>();
+    }
+    std::string text() {
+        uint32_t size = u32();
+        const unsigned char *data = take(size);
+        return data ? std::string((const char *)data, size) : std::string();
+    }
+
+private:
+    const unsigned char *pos;
+    const unsigned char *end;
+};
+
+// The cache file, mapped read only
+class MappedFile {
+public:
+    ~MappedFile() {
+        unmap();
+    }
+
+    bool map(const std::string &path) {
+        unmap();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file, &length) || length.QuadPart < LONGLONG(sizeof(Header))) {
+            unmap();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!view) {
+            unmap();
+            return false;
+        }
+        size = size_t(length.QuadPart);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return false;
+        struct stat st;
+        void *view = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= off_t(sizeof(Header)))
+            view = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (view == MAP_FAILED)
+            return false;
+        size = size_t(st.st_size);
+#endif
+        data = (const unsigned char *)view;
+        return true;
+    }
+
+    void unmap() {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap((void *)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+static std::string cacheDir() {
+#ifdef _WIN32
+    const char *base = getenv("LOCALAPPDATA");
+    return base ? std::string(base) + "\\web-eid" : std::string();
+#else
+    const char *home = getenv("HOME");
+#ifdef __APPLE__
+    return home ? std::string(home) + "/Library/Caches/web-eid" : std::string();
+#else
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return std::string(xdg) + "/web-eid";
+    return home ? std::string(home) + "/.cache/web-eid" : std::string();
+#endif
+#endif
+}
+
+static std::string cachePath() {
+    std::string dir = cacheDir();
+#ifdef _WIN32
+    return dir.empty() ? dir : dir + "\\certificates.cache";
+#else
+    return dir.empty() ? dir : dir + "/certificates.cache";
+#endif
+}
+
+// Also creates the parents, errors show up when the file is written
+static void makeDir(const std::string &dir) {
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+        mkdir(dir.substr(0, slash).c_str(), 0700);
+        if (slash == std::string::npos)
+            break;
+    }
+#endif
+}
+
+static std::mutex cacheMutex;
+static MappedFile mapped;
+static bool attempted = false;
+
+// Maps the file once, and again after it has been written. The records are
+// left out if the file is not one of ours.
+static bool records(const unsigned char *&data, size_t &size, uint32_t &count) {
+    if (!attempted) {
+        attempted = true;
+        std::string path = cachePath();
+        if (!path.empty() && mapped.map(path)) {
+            Header header;
+            memcpy(&header, mapped.data, sizeof(header));
+            const unsigned char *body = mapped.data + sizeof(header);
+            if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != FORMAT ||
+                    header.size != mapped.size - sizeof(header) || header.checksum != checksum(body, size_t(header.size))) {
+                _log_warning(P11, "Ignoring invalid certificate cache %s", path.c_str());
+                mapped.unmap();
+            }
+        }
+    }
+    if (!mapped.data)
+        return false;
+    Header header;
+    memcpy(&header, mapped.data, sizeof(header));
+    data = mapped.data + sizeof(header);
+    size = size_t(header.size);
+    count = header.count;
+    return true;
+}
+
+// Calls visit(token, record, size) for every record, until it returns false
+template <typename Visit>
+static void eachRecord(Visit visit) {
+    const unsigned char *data;
+    size_t size;
+    uint32_t count;
+    if (!records(data, size, count))
+        return;
+    Reader in(data, size);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length = in.u32();
+        const unsigned char *record = in.take(length);
+        if (!record)
+            return;
+        Reader key(record, length);
+        std::string token = key.text();
+        if (!key.ok || !visit(token, record, size_t(length)))
+            return;
+    }
+}
+
+static bool write(const std::string &records, uint32_t count) {
+    std::string path = cachePath();
+    if (path.empty())
+        return false;
+    makeDir(cacheDir());
+    Header header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT;
+    header.count = count;
+    header.size = records.size();
+    header.checksum = checksum((const unsigned char *)records.data(), records.size());
+
+    // Written aside and renamed over, other hosts may be reading it
+#ifdef _WIN32
+    std::string temp = path + "." + std::to_string(GetCurrentProcessId());
+#else
+    std::string temp = path + "." + std::to_string(getpid());
+#endif
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(records.data(), 1, records.size(), file) == records.size();
+    ok = fclose(file) == 0 && ok;
+    mapped.unmap();
+    attempted = false;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok) {
+        _log_warning(P11, "Could not write certificate cache %s", path.c_str());
+        remove(temp.c_str());
+    }
+    return ok;
+}
+
+// Rewrites the file with the record of the token first, or without it
+static void replace(const std::string &token, const std::string *record) {
+    Writer out;
+    uint32_t count = 0;
+    if (record) {
+        out.bytes(record->data(), record->size());
+        count++;
+    }
+    eachRecord([&](const std::string &other, const unsigned char *data, size_t size) {
+        if (other != token && count < MAX_TOKENS) {
+            out.bytes(data, size);
+            count++;
+        }
+        return true;
+    });
+    write(out.data, count);
+}
+
+bool CertificateCache::enabled() {
+    static const bool enabled = [] {
+        const char *env = getenv("WEB_EID_CERT_CACHE");
+        return !env || strcmp(env, "0") != 0;
+    }();
+    return enabled;
+}
+
+bool CertificateCache::find(const std::string &token, std::vector<CachedCertificate> &certs) {
+    if (!enabled())
+        return false;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    bool found = false;
+    eachRecord([&](const std::string &other, const unsigned char *data, size_t size) {
+        if (other != token)
+            return true;
+        Reader in(data, size);
+        in.text();
+        int64_t stored = in.i64();
+        if (int64_t(time(nullptr)) - stored > MAX_AGE) {
+            _log_p11("Cached certificates are too old");
+            return false;
+        }
+        uint32_t count = in.u32();
+        std::vector<CachedCertificate> result;
+        for (uint32_t i = 0; i < count && in.ok; i++) {
+            result.push_back(CachedCertificate());
+            CachedCertificate &cert = result.back();
+            cert.id = in.blob();
+            cert.keyType = in.u32();
+            cert.der = in.blob();
+        }
+        found = in.ok && result.size() == count;
+        if (found)
+            certs.swap(result);
+        return false;
+    });
+    return found;
+}
+
+void CertificateCache::store(const std::string &token, const std::vector<CachedCertificate> &certs) {
+    if (!enabled())
+        return;
+    Writer out;
+    out.text(token);
+    out.i64(int64_t(time(nullptr)));
+    out.u32(uint32_t(certs.size()));
+    for (const CachedCertificate &cert: certs) {
+        out.blob(cert.id);
+        out.u32(uint32_t(cert.keyType));
+        out.blob(cert.der);
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    replace(token, &out.data);
+}
+
+void CertificateCache::forget(const std::string &token) {
+    if (!enabled())
+        return;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    replace(token, nullptr);
+}
@@ -0,0 +1,46 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A certificate of a token as it was found when the token was enumerated
+struct CachedCertificate {
+    std::vector<unsigned char> id; // CKA_ID
+    unsigned long keyType = 0; // CKA_KEY_TYPE
+    std::vector<unsigned char> der; // CKA_VALUE, parsed again when used
+};
+
+// Certificates of tokens, kept in a file in the user's cache directory
+// across launches of the host, so that the certificates and keys of a token
+// that was seen before are not read again. The token is still asked for the
+// number of its certificates and the first one of them, see
+// PKCS11Module::enumerate(). The file is memory-mapped, versioned and checksummed,
+// anything unexpected in it is ignored. Tokens are identified by the module
+// and the serial number of the token. WEB_EID_CERT_CACHE=0 disables it.
+class CertificateCache {
+public:
+    // False if the token is not known or was stored too long ago
+    static bool find(const std::string &token, std::vector<CachedCertificate> &certs);
+    static void store(const std::string &token, const std::vector<CachedCertificate> &certs);
+    // For when the certificates turn out to be wrong
+    static void forget(const std::string &token);
+    static bool enabled();
+};
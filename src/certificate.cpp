@@ -0,0 +1,91 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "certificate.h"
+#include "Logger.h"
+#include "der.h"
+
+#include <openssl/sha.h>
+
+#include <mutex>
+#include <unordered_map>
+
+CertificateInfo CertificateInfo::parse(const std::vector<unsigned char> &der) {
+    CertificateInfo info;
+    info.der = der;
+    info.fingerprint = fingerprintOf(der);
+
+    X509Fields fields;
+    if (!fields.parse(der.data(), der.size())) {
+        _log_p11("Could not parse the certificate");
+        return info;
+    }
+    info.subjectCN = X509Fields::text(fields.subjectCN);
+    info.subjectO = X509Fields::text(fields.subjectO);
+    info.subjectOU = X509Fields::text(fields.subjectOU);
+    info.issuerCN = X509Fields::text(fields.issuerCN);
+    info.expiry = fields.notAfter;
+    info.keyType = fields.isEcKey() ? EcKey : RsaKey;
+    info.keyBits = fields.keyBits();
+
+    // Without basicConstraints it is not known to be an end entity
+    info.ca = !fields.hasBasicConstraints || fields.ca;
+    bool isSSLClient = fields.hasExtendedKeyUsage(OID::clientAuth);
+    bool isNonRepudiation = (fields.keyUsage & X509Fields::NonRepudiation) != 0;
+    if (isSSLClient)
+        info.purposes |= Authentication;
+    if (isNonRepudiation)
+        info.purposes |= Signing;
+    _log_p11("Certificate flags: ca=%d auth=%d nonrepu=%d", info.ca, isSSLClient, isNonRepudiation);
+    return info;
+}
+
+Fingerprint CertificateInfo::fingerprintOf(const std::vector<unsigned char> &der) {
+    Fingerprint result;
+    SHA256(der.data(), der.size(), result.data());
+    return result;
+}
+
+// Entries go away when no token refers to them any more
+static std::mutex storeMutex;
+static std::unordered_map<Fingerprint, std::weak_ptr<const CertificateInfo>, FingerprintHash> store;
+
+std::shared_ptr<const CertificateInfo> CertificateStore::add(const std::vector<unsigned char> &der) {
+    Fingerprint fingerprint = CertificateInfo::fingerprintOf(der);
+    if (std::shared_ptr<const CertificateInfo> info = find(fingerprint))
+        return info;
+    // Parsed without the lock, another thread may add it meanwhile
+    std::shared_ptr<const CertificateInfo> parsed = std::make_shared<const CertificateInfo>(CertificateInfo::parse(der));
+    std::lock_guard<std::mutex> lock(storeMutex);
+    std::weak_ptr<const CertificateInfo> &entry = store[fingerprint];
+    if (std::shared_ptr<const CertificateInfo> info = entry.lock())
+        return info;
+    entry = parsed;
+    return parsed;
+}
+
+std::shared_ptr<const CertificateInfo> CertificateStore::find(const Fingerprint &fingerprint) {
+    std::lock_guard<std::mutex> lock(storeMutex);
+    auto entry = store.find(fingerprint);
+    if (entry == store.end())
+        return nullptr;
+    std::shared_ptr<const CertificateInfo> info = entry->second.lock();
+    if (!info)
+        store.erase(entry);
+    return info;
+}
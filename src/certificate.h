@@ -0,0 +1,81 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "Common.h"
+
+#include <array>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ctime>
+
+// SHA-256 of the DER, identifies a certificate
+typedef std::array<unsigned char, 32> Fingerprint;
+
+struct FingerprintHash {
+    // The fingerprint is already a good hash
+    size_t operator()(const Fingerprint &f) const {
+        size_t h;
+        memcpy(&h, f.data(), sizeof(h));
+        return h;
+    }
+};
+
+// What the host needs to know about a certificate, extracted once
+// when the token is enumerated
+struct CertificateInfo {
+    std::vector<unsigned char> der;
+    Fingerprint fingerprint;
+    unsigned purposes = UnknownPurpose; // CertificatePurpose bits
+    bool ca = true;
+    std::string subjectCN;
+    std::string subjectO;
+    std::string subjectOU;
+    std::string issuerCN;
+    time_t expiry = 0;
+    KeyType keyType = RsaKey; // of the subject public key
+    int keyBits = 0; // modulus or curve size
+
+    // CN and OU of the subject, for logs and dialogs
+    std::string subject() const {
+        return subjectOU.empty() ? subjectCN : subjectCN + " " + subjectOU;
+    }
+
+    bool usableFor(CertificatePurpose type) const {
+        return !ca && (purposes & type);
+    }
+
+    bool expired() const {
+        return time(nullptr) >= expiry;
+    }
+
+    static CertificateInfo parse(const std::vector<unsigned char> &der);
+    static Fingerprint fingerprintOf(const std::vector<unsigned char> &der);
+};
+
+// Certificates by fingerprint, shared by all tokens and modules, so that
+// a certificate visible through several slots or modules is stored and
+// parsed once
+class CertificateStore {
+public:
+    static std::shared_ptr<const CertificateInfo> add(const std::vector<unsigned char> &der);
+    static std::shared_ptr<const CertificateInfo> find(const Fingerprint &fingerprint);
+};
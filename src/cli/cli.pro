@@ -0,0 +1,17 @@
+# hwcrypto-cli, the core from the command line
+TEMPLATE = app
+TARGET = hwcrypto-cli
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+OBJECTS_DIR = build
+include(../core.pri)
+win32 {
+    CONFIG(debug, debug|release): CORE_DIR = $$OUT_PWD/../core/debug
+    else: CORE_DIR = $$OUT_PWD/../core/release
+    PRE_TARGETDEPS += $$CORE_DIR/hwcrypto-core.lib
+} else {
+    CORE_DIR = $$OUT_PWD/../core
+    PRE_TARGETDEPS += $$CORE_DIR/libhwcrypto-core.a
+}
+LIBS = -L$$CORE_DIR -lhwcrypto-core $$LIBS
+SOURCES += hwcrypto-cli.cpp
@@ -0,0 +1,156 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+// Lists readers and certificates and signs hashes with the same engine as
+// the browser host, without Qt, for scripts and batch jobs
+
+#include "modulemap.h"
+#include "pcsc.h"
+#include "pkcs11module.h"
+#include "util.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int usage() {
+    fprintf(stderr, "Usage: hwcrypto-cli [-m module] command\n"
+            "  readers                      list readers and the cards in them\n"
+            "  certs                        list certificates by SHA-256 fingerprint\n"
+            "  sign FINGERPRINT [HASHALGO]  sign the hashes on stdin, in hex, one per line.\n"
+            "                               Signatures go to stdout in the same order.\n"
+            "Modules are chosen by the cards in the readers, unless given with -m.\n"
+            "The PIN is taken from WEB_EID_PIN, unless the reader has a pinpad.\n");
+    return 2;
+}
+
+static bool isHex(const std::string &text) {
+    return text.size() % 2 == 0 && std::all_of(text.begin(), text.end(), [](char c) { return isxdigit((unsigned char)c) != 0; });
+}
+
+// Names as in the browser protocol. Without a name the hash length tells.
+static bool hashAlgorithm(const std::string &name, HashAlgorithm &algorithm) {
+    static const char *names[] = {"SHA-1", "SHA-224", "SHA-256", "SHA-384", "SHA-512"};
+    algorithm = UnknownHash;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (name == names[i])
+            algorithm = HashAlgorithm(Sha1Hash + i);
+    }
+    return algorithm != UnknownHash || name.empty();
+}
+
+static int readers() {
+    for (const PCSCReader &reader: PCSC::readerList()) {
+        std::string card = reader.atr.empty() ? std::string() : P11Modules::getCardName(reader.atr);
+        printf("%s\t%s\t%s\n", reader.name.c_str(), toHex(reader.atr).c_str(), card.c_str());
+    }
+    return 0;
+}
+
+static int certs(const PKCS11Registry &registry) {
+    for (const CertificateInfo &cert: registry.getCerts(CertificatePurpose(Authentication | Signing))) {
+        char expiry[16] = "";
+        strftime(expiry, sizeof(expiry), "%Y-%m-%d", gmtime(&cert.expiry));
+        const char *purposes = cert.purposes == (Authentication | Signing) ? "auth,sign" : cert.purposes & Authentication ? "auth" : "sign";
+        printf("%s\t%s\t%s\t%s\n", toHex(std::vector<unsigned char>(cert.fingerprint.begin(), cert.fingerprint.end())).c_str(), purposes, expiry, cert.subject().c_str());
+    }
+    return 0;
+}
+
+static int sign(const PKCS11Registry &registry, const std::string &hex, const std::string &name) {
+    Fingerprint fingerprint;
+    if (hex.size() != 2 * fingerprint.size() || !isHex(hex)) {
+        fprintf(stderr, "Not a SHA-256 fingerprint: %s\n", hex.c_str());
+        return 2;
+    }
+    std::vector<unsigned char> bytes = hex2v(hex);
+    std::copy(bytes.begin(), bytes.end(), fingerprint.begin());
+    HashAlgorithm algorithm;
+    if (!hashAlgorithm(name, algorithm)) {
+        fprintf(stderr, "Unknown hash algorithm: %s\n", name.c_str());
+        return 2;
+    }
+    PKCS11Module *module = registry.find(fingerprint);
+    if (!module) {
+        fprintf(stderr, "Certificate not found: %s\n", hex.c_str());
+        return 1;
+    }
+
+    std::vector<std::vector<unsigned char>> hashes;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        line.erase(line.find_last_not_of(" \r\t") + 1);
+        if (line.empty())
+            continue;
+        if (!isHex(line)) {
+            fprintf(stderr, "Not a hash in hex: %s\n", line.c_str());
+            return 2;
+        }
+        hashes.push_back(hex2v(line));
+    }
+    if (hashes.empty())
+        return 0;
+
+    const char *pin = module->isPinpad(fingerprint) ? nullptr : getenv("WEB_EID_PIN");
+    if (!pin && !module->isPinpad(fingerprint)) {
+        fprintf(stderr, "WEB_EID_PIN is not set\n");
+        return 2;
+    }
+    CK_RV rv = module->needsLogin(fingerprint) ? module->login(fingerprint, pin) : CKR_OK;
+    if (rv == CKR_OK) {
+        rv = module->signMany(fingerprint, hashes, std::vector<HashAlgorithm>(hashes.size(), algorithm), [](size_t, const std::vector<unsigned char> &signature) {
+            printf("%s\n", toHex(signature).c_str());
+            fflush(stdout);
+        });
+    }
+    if (rv != CKR_OK) {
+        fprintf(stderr, "Signing failed: %s\n", PKCS11Module::errorName(rv));
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    std::string module;
+    int arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "-m") == 0) {
+        module = argv[arg + 1];
+        arg += 2;
+    }
+    if (arg >= argc)
+        return usage();
+    std::string command = argv[arg++];
+    if (command == "readers")
+        return readers();
+    if (command != "certs" && command != "sign")
+        return usage();
+
+    PKCS11Registry registry;
+    registry.load(module.empty() ? P11Modules::getPaths(PCSC::atrList()) : std::vector<std::string>{module}, 0);
+    if (command == "certs")
+        return certs(registry);
+    if (arg >= argc)
+        return usage();
+    return sign(registry, argv[arg], arg + 1 < argc ? argv[arg + 1] : "");
+}
@@ -0,0 +1,33 @@
+# The token and card engine, without Qt. Used by the host, which builds
+# the sources itself, and by core/core.pro and cli/cli.pro.
+INCLUDEPATH += $$PWD
+CORE_SOURCES = \
+    $$PWD/Logger.cpp \
+    $$PWD/cardprofile.cpp \
+    $$PWD/certcache.cpp \
+    $$PWD/certificate.cpp \
+    $$PWD/der.cpp \
+    $$PWD/modulemap.cpp \
+    $$PWD/pcsc.cpp \
+    $$PWD/pkcs11module.cpp
+macx {
+    LIBS += -framework PCSC
+    # OpenSSL from Homebrew, e.g. qmake OPENSSL_PREFIX=/opt/local
+    isEmpty(OPENSSL_PREFIX): OPENSSL_PREFIX = /usr/local/opt/openssl
+    INCLUDEPATH += $$OPENSSL_PREFIX/include
+    LIBS += -L$$OPENSSL_PREFIX/lib -lcrypto
+}
+unix:!macx: {
+    PKGCONFIG += libpcsclite libcrypto
+    CONFIG += link_pkgconfig
+}
+unix {
+    LIBS += -ldl -lpthread
+}
+win32 {
+    isEmpty(OPENSSL_PREFIX): OPENSSL_PREFIX = C:/OpenSSL-Win32
+    INCLUDEPATH += $$OPENSSL_PREFIX/include
+    LIBS += winscard.lib -L$$OPENSSL_PREFIX/lib libeay32.lib
+}
+# Logging above this level is compiled out, e.g. qmake LOG_MAX_LEVEL=3
+!isEmpty(LOG_MAX_LEVEL): DEFINES += LOG_MAX_LEVEL=$$LOG_MAX_LEVEL
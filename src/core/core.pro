@@ -0,0 +1,10 @@
+# libhwcrypto-core, the PC/SC, PKCS#11 and certificate engine of the host
+# as a static library without Qt
+TEMPLATE = lib
+TARGET = hwcrypto-core
+CONFIG += staticlib c++11
+CONFIG -= qt
+OBJECTS_DIR = build
+include(../core.pri)
+SOURCES += $$CORE_SOURCES
+HEADERS += $$files(../*.h)
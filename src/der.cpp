@@ -0,0 +1,274 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "der.h"
+
+#include <cstdint>
+
+namespace OID {
+static const unsigned char commonName[] = {0x55, 0x04, 0x03};
+static const unsigned char organizationName[] = {0x55, 0x04, 0x0A};
+static const unsigned char organizationalUnitName[] = {0x55, 0x04, 0x0B};
+static const unsigned char keyUsage[] = {0x55, 0x1D, 0x0F};
+static const unsigned char basicConstraints[] = {0x55, 0x1D, 0x13};
+static const unsigned char extKeyUsage[] = {0x55, 0x1D, 0x25};
+static const unsigned char ecPublicKey[] = {0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01};
+static const unsigned char secp256r1[] = {0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07};
+static const unsigned char secp224r1[] = {0x2B, 0x81, 0x04, 0x00, 0x21};
+static const unsigned char secp384r1[] = {0x2B, 0x81, 0x04, 0x00, 0x22};
+static const unsigned char secp521r1[] = {0x2B, 0x81, 0x04, 0x00, 0x23};
+static const unsigned char brainpoolP256r1[] = {0x2B, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x07};
+static const unsigned char brainpoolP384r1[] = {0x2B, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x0B};
+static const unsigned char brainpoolP512r1[] = {0x2B, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x0D};
+}
+
+bool DERReader::next(DERView &value) {
+    // High tag numbers do not occur in certificates
+    if (end - p < 2 || (p[0] & 0x1F) == 0x1F) {
+        p = end;
+        return false;
+    }
+    const unsigned char *q = p + 1;
+    size_t length = *q++;
+    if (length & 0x80) {
+        size_t bytes = length & 0x7F;
+        if (bytes == 0 || bytes > sizeof(uint32_t) || size_t(end - q) < bytes) {
+            p = end;
+            return false;
+        }
+        for (length = 0; bytes > 0; bytes--)
+            length = (length << 8) | *q++;
+    }
+    if (size_t(end - q) < length) {
+        p = end;
+        return false;
+    }
+    value.tag = p[0];
+    value.data = q;
+    value.size = length;
+    p = q + length;
+    return true;
+}
+
+bool DERReader::next(unsigned char tag, DERView &value) {
+    return p != end && *p == tag && next(value);
+}
+
+// The first CN, O and OU of a Name
+static void names(const DERView &name, DERView &cn, DERView &o, DERView *ou) {
+    DERReader rdns(name);
+    DERView rdn;
+    while (rdns.next(DERReader::Set, rdn)) {
+        DERReader attributes(rdn);
+        DERView attribute;
+        while (attributes.next(DERReader::Sequence, attribute)) {
+            DERReader fields(attribute);
+            DERView type, value;
+            if (!fields.next(DERReader::Oid, type) || !fields.next(value))
+                continue;
+            DERView *field = type.is(OID::commonName) ? &cn : type.is(OID::organizationName) ? &o : type.is(OID::organizationalUnitName) ? ou : nullptr;
+            if (field && field->empty())
+                *field = value;
+        }
+    }
+}
+
+// UTCTime or GeneralizedTime in UTC, 0 if malformed
+static time_t x509time(const DERView &value) {
+    size_t yearDigits = value.tag == DERReader::UTCTime ? 2 : value.tag == DERReader::GeneralizedTime ? 4 : 0;
+    if (yearDigits == 0 || value.size < yearDigits + 10)
+        return 0;
+    auto digits = [&value](size_t pos, size_t count) {
+        int result = 0;
+        for (size_t i = pos; i < pos + count; i++) {
+            if (value.data[i] < '0' || value.data[i] > '9')
+                return -1;
+            result = result * 10 + (value.data[i] - '0');
+        }
+        return result;
+    };
+    int year = digits(0, yearDigits);
+    int month = digits(yearDigits, 2), day = digits(yearDigits + 2, 2);
+    int hour = digits(yearDigits + 4, 2), minute = digits(yearDigits + 6, 2), second = digits(yearDigits + 8, 2);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31 || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+        return 0;
+    if (yearDigits == 2)
+        year += year < 50 ? 2000 : 1900;
+    // Days since 1970-01-01 in the proleptic Gregorian calendar, timegm is
+    // not portable
+    int y = year - (month <= 2);
+    int era = y / 400;
+    int yearOfEra = y - era * 400;
+    int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    long long days = era * 146097LL + yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear - 719468;
+    return time_t(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+bool X509Fields::parse(const unsigned char *der, size_t size) {
+    *this = X509Fields();
+    DERView certificate, tbs, value, issuer, validity, subject, spki;
+    if (!DERReader(der, size).next(DERReader::Sequence, certificate) || !DERReader(certificate).next(DERReader::Sequence, tbs))
+        return false;
+    DERReader fields(tbs);
+    fields.next(0xA0, value); // version
+    if (!fields.next(DERReader::Integer, value) || !fields.next(DERReader::Sequence, value) || !fields.next(DERReader::Sequence, issuer)
+        || !fields.next(DERReader::Sequence, validity) || !fields.next(DERReader::Sequence, subject) || !fields.next(DERReader::Sequence, spki))
+        return false;
+    names(issuer, issuerCN, issuerO, nullptr);
+    names(subject, subjectCN, subjectO, &subjectOU);
+
+    DERReader times(validity);
+    if (!times.next(value) || !times.next(value))
+        return false;
+    notAfter = x509time(value);
+
+    DERReader key(spki);
+    DERView algorithm;
+    if (!key.next(DERReader::Sequence, algorithm) || !key.next(DERReader::BitString, publicKey) || publicKey.empty())
+        return false;
+    publicKey.data++;
+    publicKey.size--;
+    DERReader algorithmFields(algorithm);
+    if (!algorithmFields.next(DERReader::Oid, keyAlgorithm))
+        return false;
+    algorithmFields.next(keyParameters);
+
+    // The unique identifiers come before the extensions
+    DERView extensions;
+    while (fields.next(value)) {
+        if (value.tag == 0xA3 && !DERReader(value).next(DERReader::Sequence, extensions))
+            return false;
+    }
+    DERReader list(extensions);
+    DERView extension;
+    while (list.next(DERReader::Sequence, extension)) {
+        DERReader extensionFields(extension);
+        DERView id, content;
+        extensionFields.next(DERReader::Oid, id);
+        extensionFields.next(DERReader::Boolean, value); // critical
+        if (!extensionFields.next(DERReader::OctetString, content))
+            return false;
+        if (id.is(OID::basicConstraints)) {
+            hasBasicConstraints = true;
+            DERView constraints, flag;
+            DERReader(content).next(DERReader::Sequence, constraints);
+            ca = DERReader(constraints).next(DERReader::Boolean, flag) && flag.size == 1 && flag.data[0] != 0;
+        } else if (id.is(OID::keyUsage)) {
+            DERView bits;
+            if (!DERReader(content).next(DERReader::BitString, bits))
+                return false;
+            // The first bit is the most significant of the first byte
+            for (size_t i = 1; i < bits.size && i <= sizeof(keyUsage); i++) {
+                for (int bit = 0; bit < 8; bit++) {
+                    if (bits.data[i] & (0x80 >> bit))
+                        keyUsage |= 1u << ((i - 1) * 8 + bit);
+                }
+            }
+        } else if (id.is(OID::extKeyUsage)) {
+            DERReader(content).next(DERReader::Sequence, extendedKeyUsage);
+        }
+    }
+    return true;
+}
+
+bool X509Fields::isEcKey() const {
+    return keyAlgorithm.is(OID::ecPublicKey);
+}
+
+int X509Fields::keyBits() const {
+    if (isEcKey()) {
+        if (keyParameters.is(OID::secp256r1) || keyParameters.is(OID::brainpoolP256r1))
+            return 256;
+        if (keyParameters.is(OID::secp384r1) || keyParameters.is(OID::brainpoolP384r1))
+            return 384;
+        if (keyParameters.is(OID::secp521r1))
+            return 521;
+        if (keyParameters.is(OID::brainpoolP512r1))
+            return 512;
+        if (keyParameters.is(OID::secp224r1))
+            return 224;
+        // Other curves by the length of an uncompressed point
+        return publicKey.size > 1 && publicKey.data[0] == 0x04 ? int(publicKey.size - 1) / 2 * 8 : 0;
+    }
+    // RSAPublicKey is a SEQUENCE of the modulus and the exponent
+    DERView rsa, modulus;
+    if (!DERReader(publicKey).next(DERReader::Sequence, rsa) || !DERReader(rsa).next(DERReader::Integer, modulus))
+        return 0;
+    size_t skip = 0;
+    while (skip < modulus.size && modulus.data[skip] == 0)
+        skip++;
+    if (skip == modulus.size)
+        return 0;
+    int bits = int(modulus.size - skip - 1) * 8;
+    for (unsigned char top = modulus.data[skip]; top; top >>= 1)
+        bits++;
+    return bits;
+}
+
+static void appendUtf8(std::string &result, uint32_t c) {
+    if (c > 0x10FFFF)
+        c = 0xFFFD;
+    if (c < 0x80) {
+        result += char(c);
+    } else if (c < 0x800) {
+        result += char(0xC0 | (c >> 6));
+        result += char(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        result += char(0xE0 | (c >> 12));
+        result += char(0x80 | ((c >> 6) & 0x3F));
+        result += char(0x80 | (c & 0x3F));
+    } else {
+        result += char(0xF0 | (c >> 18));
+        result += char(0x80 | ((c >> 12) & 0x3F));
+        result += char(0x80 | ((c >> 6) & 0x3F));
+        result += char(0x80 | (c & 0x3F));
+    }
+}
+
+std::string X509Fields::text(const DERView &value) {
+    std::string result;
+    switch (value.tag) {
+    case DERReader::TeletexString:
+        // As Latin-1, like OpenSSL does
+        for (size_t i = 0; i < value.size; i++)
+            appendUtf8(result, value.data[i]);
+        break;
+    case DERReader::BMPString:
+        for (size_t i = 0; i + 1 < value.size; i += 2)
+            appendUtf8(result, uint32_t(value.data[i]) << 8 | value.data[i + 1]);
+        break;
+    case 0x1C: // UniversalString
+        for (size_t i = 0; i + 3 < value.size; i += 4)
+            appendUtf8(result, uint32_t(value.data[i]) << 24 | uint32_t(value.data[i + 1]) << 16 | uint32_t(value.data[i + 2]) << 8 | value.data[i + 3]);
+        break;
+    default:
+        // UTF8String and the ASCII subsets
+        result.assign((const char *)value.data, value.size);
+    }
+    return result;
+}
+
+std::string x509subject(const std::vector<unsigned char> &der) {
+    X509Fields fields;
+    fields.parse(der.data(), der.size());
+    std::string result = X509Fields::text(fields.subjectCN);
+    if (!fields.subjectOU.empty())
+        result += " " + X509Fields::text(fields.subjectOU);
+    return result;
+}
@@ -0,0 +1,126 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Bytes inside a DER encoding, nothing is copied
+struct DERView {
+    unsigned char tag = 0;
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+
+    bool empty() const {
+        return size == 0;
+    }
+    template <size_t N>
+    bool is(const unsigned char (&oid)[N]) const {
+        return size == N && std::equal(oid, oid + N, data);
+    }
+};
+
+// Walks the elements of a constructed DER value one at a time. Only the
+// definite lengths and single byte tags of DER are accepted.
+class DERReader {
+public:
+    DERReader(const unsigned char *data, size_t size): p(data), end(data + size) {}
+    explicit DERReader(const DERView &view): DERReader(view.data, view.size) {}
+
+    // False at the end or on a malformed element, after which the reader
+    // stays at the end
+    bool next(DERView &value);
+    // The next element, if it has the tag. Otherwise it is not consumed.
+    bool next(unsigned char tag, DERView &value);
+    bool atEnd() const {
+        return p == end;
+    }
+
+    enum Tag : unsigned char {
+        Boolean = 0x01,
+        Integer = 0x02,
+        BitString = 0x03,
+        OctetString = 0x04,
+        Oid = 0x06,
+        UTF8String = 0x0C,
+        PrintableString = 0x13,
+        TeletexString = 0x14,
+        IA5String = 0x16,
+        UTCTime = 0x17,
+        GeneralizedTime = 0x18,
+        BMPString = 0x1E,
+        Sequence = 0x30,
+        Set = 0x31
+    };
+
+private:
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+// The parts of a certificate that the host looks at, as views into the
+// DER of the certificate. Parsing allocates nothing.
+struct X509Fields {
+    DERView subjectCN, subjectO, subjectOU; // the first of each
+    DERView issuerCN, issuerO;
+    time_t notAfter = 0;
+    DERView keyAlgorithm; // OID
+    DERView keyParameters; // the curve OID of an EC key
+    DERView publicKey; // the BIT STRING without the unused bits count
+    bool hasBasicConstraints = false;
+    bool ca = false;
+    unsigned keyUsage = 0; // KeyUsage bits, 0 if absent
+    DERView extendedKeyUsage; // the OIDs of extKeyUsage, empty if absent
+
+    enum KeyUsage {
+        DigitalSignature = 1 << 0,
+        NonRepudiation = 1 << 1,
+        KeyEncipherment = 1 << 2
+    };
+
+    bool parse(const unsigned char *der, size_t size);
+    template <size_t N>
+    bool hasExtendedKeyUsage(const unsigned char (&oid)[N]) const {
+        DERReader usages(extendedKeyUsage);
+        DERView usage;
+        while (usages.next(DERReader::Oid, usage)) {
+            if (usage.is(oid))
+                return true;
+        }
+        return false;
+    }
+    bool isEcKey() const;
+    // Modulus size or curve size, 0 if not known
+    int keyBits() const;
+
+    // A directory string as UTF-8
+    static std::string text(const DERView &value);
+};
+
+// DER encoded OIDs
+namespace OID {
+static const unsigned char clientAuth[] = {0x2B, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x02};
+}
+
+// CN and OU of the subject, for logs and dialogs
+std::string x509subject(const std::vector<unsigned char> &der);
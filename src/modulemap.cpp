@@ -21,10 +21,16 @@
 #include "pcsc.h"
 #include "util.h"
 
+#include <algorithm>
+#include <map>
+#include <mutex>
 #include <sstream>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifndef _WIN32
 #include <unistd.h>
@@ -32,10 +38,32 @@
 #else
 #include <windows.h>
 #include <io.h>
-#define F_OK 02
-#define access _access
+#define stat _stat
 #endif
 
+// Modules that could not be found by name, and the ATR lookups, are retried
+// after this many seconds. Modules with a file are checked with stat().
+static const time_t RETRY_SECONDS = 60;
+
+// Outcome of loading a module once. Valid as long as the file it was
+// loaded from has the same inode and modification time.
+struct ModuleProbe {
+    bool usable = false;
+    std::string file; // empty if the file is not known
+    unsigned long long inode = 0;
+    long long mtime = 0;
+    time_t checked = 0;
+};
+
+struct ResolvedATR {
+    std::vector<std::string> paths;
+    time_t checked;
+};
+
+static std::mutex cacheMutex;
+static std::map<std::string, ModuleProbe> probes;
+static std::map<std::string, ResolvedATR> resolved;
+
 
 // We have a list of named lists
 struct ModuleATR {
@@ -102,30 +130,145 @@ static std::vector<ModuleATR> createMap() {
         for (auto &me: e.paths) {
             msg << me << " ";
         }
-        _log("%s", msg.str().c_str());
+        _log_p11("%s", msg.str().c_str());
     }
     return m;
 }
 
+static bool fileStamp(const std::string &file, unsigned long long &inode, long long &mtime) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+        return false;
+    inode = (unsigned long long)st.st_ino;
+    mtime = (long long)st.st_mtime;
+    return true;
+}
+
+#ifdef _WIN32
+typedef HINSTANCE LibraryHandle;
+#else
+typedef void *LibraryHandle;
+#endif
+
+// The file a module given by name was loaded from
+static std::string loadedFrom(LibraryHandle handle) {
+#ifdef _WIN32
+    char name[MAX_PATH];
+    DWORD len = GetModuleFileNameA(handle, name, MAX_PATH);
+    return len > 0 && len < MAX_PATH ? std::string(name, len) : std::string();
+#else
+    Dl_info info;
+    void *symbol = dlsym(handle, "C_GetFunctionList");
+    if (symbol && dladdr(symbol, &info) && info.dli_fname)
+        return info.dli_fname;
+    return std::string();
+#endif
+}
+
+// Returns true if the module loads. Only loads it the first time or
+// after the file has changed. Called with cacheMutex held.
+static bool probe(const std::string &path) {
+    auto cached = probes.find(path);
+    if (cached != probes.end()) {
+        const ModuleProbe &p = cached->second;
+        unsigned long long inode;
+        long long mtime;
+        if (p.file.empty() && time(nullptr) - p.checked < RETRY_SECONDS)
+            return p.usable;
+        if (!p.file.empty() && fileStamp(p.file, inode, mtime) && inode == p.inode && mtime == p.mtime)
+            return p.usable;
+    }
+
+    ModuleProbe &p = probes[path];
+    p = ModuleProbe();
+    p.checked = time(nullptr);
+    // 1. If module contains path separators, check if file exists
+    if (path.find_first_of("/\\") != std::string::npos) {
+        p.file = path;
+        if (!fileStamp(path, p.inode, p.mtime)) {
+            _log_p11("ignoring missing PKCS#11 module %s", path.c_str());
+            return false;
+        }
+    }
+    // try to open
+    // TODO: maybe check if function list present ?
+#ifdef _WIN32
+    LibraryHandle handle = LoadLibraryA(path.c_str());
+#else
+    LibraryHandle handle = dlopen(path.c_str(), RTLD_LOCAL | RTLD_NOW);
+#endif
+    if (!handle) {
+        _log_p11("ignoring PKCS#11 module that did not load: %s", path.c_str());
+        return false;
+    }
+    if (p.file.empty()) {
+        p.file = loadedFrom(handle);
+        if (!p.file.empty() && !fileStamp(p.file, p.inode, p.mtime))
+            p.file.clear();
+    }
+#ifdef _WIN32
+    FreeLibrary(handle);
+#else
+    dlclose(handle);
+#endif
+    // Assume usable module if dlopen is successful
+    p.usable = true;
+    return true;
+}
+
+static const std::vector<ModuleATR> &knownCards() {
+    static const std::vector<ModuleATR> list = createMap();
+    return list;
+}
+
+static std::string upperHex(const std::vector<unsigned char> &atr) {
+    std::string key = toHex(atr);
+    std::transform(key.begin(), key.end(), key.begin(), ::toupper);
+    return key;
+}
+
+// Only specific ATR-s name the card, wildcards do not
+std::string P11Modules::getCardName(const std::vector<unsigned char> &atr) {
+    const std::vector<ModuleATR> &atrToDriverList = knownCards();
+    std::string key = upperHex(atr);
+    for (const auto &conf: atrToDriverList) {
+        if (std::find(conf.atrs.cbegin(), conf.atrs.cend(), key) != conf.atrs.cend())
+            return conf.name;
+    }
+    return std::string();
+}
+
 // Given a list of ATR-s, return a list of PKCS#11 modules.
 // We do not know which ATR is of the card that is supposed to be used
 // nor do we know for sure which card is handled by which driver.
 
 std::vector<std::string> P11Modules::getPaths(const std::vector<std::vector<unsigned char>> &atrs) {
-    static const std::vector<ModuleATR> atrToDriverList = createMap();
+    const std::vector<ModuleATR> &atrToDriverList = knownCards();
     std::vector<std::string> result;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    time_t now = time(nullptr);
 
     // For every ATR ...
     for (const auto &atrbytes: atrs) {
         // convert ATR byte array to upper case HEX
-        std::string key = toHex(atrbytes);
-        std::transform(key.begin(), key.end(), key.begin(), ::toupper);
-        _log("Looking for %s", key.c_str());
+        std::string key = upperHex(atrbytes);
+
+        // Reuse the earlier answer while its modules are unchanged
+        auto memo = resolved.find(key);
+        if (memo != resolved.end() && now - memo->second.checked < RETRY_SECONDS &&
+                std::all_of(memo->second.paths.cbegin(), memo->second.paths.cend(), probe)) {
+            _log_p11("Using known modules for %s", key.c_str());
+            result.insert(result.end(), memo->second.paths.begin(), memo->second.paths.end());
+            continue;
+        }
+
+        _log_p11("Looking for %s", key.c_str());
+        std::vector<std::string> paths;
         for (const auto &conf: atrToDriverList) {
             // Checking if ATR matches one in the list
             bool atr_match = std::any_of(conf.atrs.cbegin(), conf.atrs.cend(), [&](const std::string &atr) {
                 if (atr == "*" || atr == key) {
-                    _log("ATR matches %s: %s", conf.name.c_str(), atr.c_str());
+                    _log_p11("ATR matches %s: %s", conf.name.c_str(), atr.c_str());
                     return true;
                 }
                 return false;
@@ -135,38 +278,18 @@ std::vector<std::string> P11Modules::getPaths(const std::vector<std::vector<unsi
                 continue;
             // Check if any of the modules is usable/available
             for (const auto &path: conf.paths) {
-                // 1. If module contains path separators, check if file exists
-                if (path.find_first_of("/\\") != std::string::npos) {
-                    if (access(path.c_str(), F_OK ) == -1) {
-                        _log("ignoring missing PKCS#11 module %s", path.c_str());
-                        continue;
-                    }
-                }
-                // try to open XXX: wrap in some common header
-                // TODO: maybe check if function list present ?
-#ifdef _WIN32
-                HINSTANCE handle = LoadLibraryA(path.c_str());
-#else
-                void *handle = dlopen(path.c_str(), RTLD_LOCAL | RTLD_NOW);
-#endif
-                if (!handle) {
-                    _log("ignoring PKCS#11 module that did not load: %s", path.c_str());
+                if (!probe(path))
                     continue;
-                }
-#ifdef _WIN32
-                FreeLibrary(handle);
-#else
-                dlclose(handle);
-#endif
-                // Assume usable module if dlopen is successful
-                result.push_back(path);
-                _log("%s found usable as %s via %s", key.c_str(), conf.name.c_str(), path.c_str());
+                paths.push_back(path);
+                _log_p11("%s found usable as %s via %s", key.c_str(), conf.name.c_str(), path.c_str());
                 break;
             }
         }
+        resolved[key] = ResolvedATR({paths, now});
+        result.insert(result.end(), paths.begin(), paths.end());
     }
     if (result.empty()) {
-        _log("no suitable drivers found for a total of %d cards", atrs.size());
+        _log_p11("no suitable drivers found for a total of %zu cards", atrs.size());
     }
     return result;
 }
@@ -22,4 +22,6 @@
 class P11Modules {
 public:
     static std::vector<std::string> getPaths(const std::vector<std::vector<unsigned char> > &atrs);
+    // Name of the card in the ATR table, empty if not known
+    static std::string getCardName(const std::vector<unsigned char> &atr);
 };
@@ -20,14 +20,37 @@
 #include "Logger.h"
 #include "util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Results that are part of normal operation, not worth a warning
+static bool routine(LONG err) {
+    switch (err) {
+    case SCARD_S_SUCCESS:
+    case SCARD_E_CANCELLED:
+    case SCARD_E_INSUFFICIENT_BUFFER:
+    case SCARD_E_NO_READERS_AVAILABLE:
+    case SCARD_E_TIMEOUT:
+        return true;
+    default:
+        return false;
+    }
+}
 
 template < typename Func, typename... Args>
 LONG SCCall(const char *fun, const char *file, int line, const char *function, Func func, Args... args)
 {
     // TODO: log parameters
     LONG err = func(args...);
-    Logger::writeLog(fun, file, line, "%s: %s", function, PCSC::errorName(err));
+    Logger::Level level = routine(err) ? Logger::Debug : Logger::Warning;
+    if (LOG_ENABLED(level, Logger::PCSC))
+        Logger::writeLog(fun, file, line, "%s: %s", function, PCSC::errorName(err));
     return err;
 }
 #define SCard(API, ...) SCCall(__FUNCTION__, __FILE__, __LINE__, "SCard"#API, SCard##API, __VA_ARGS__)
@@ -36,7 +59,7 @@ LONG SCCall(const char *fun, const char *file, int line, const char *function, F
 #define check_SCard(API, ...) do { \
     LONG _ret = SCCall(__FUNCTION__, __FILE__, __LINE__, "SCard"#API, SCard##API, __VA_ARGS__); \
     if (_ret != SCARD_S_SUCCESS) { \
-       Logger::writeLog(__FUNCTION__, __FILE__, __LINE__, "returning %s", PCSC::errorName(_ret)); \
+       _log_at(Logger::Debug, Logger::PCSC, "returning %s", PCSC::errorName(_ret)); \
        return _ret; \
     } \
 } while(0)
@@ -62,7 +85,15 @@ SCARDCONTEXT PCSC::getContext() {
 }
 
 LONG PCSC::connect(const std::string &reader, const std::string &protocol) {
-    _log("Connecting to card in %s with %s", reader.c_str(), protocol.c_str());
+    return open(reader, protocol, false);
+}
+
+LONG PCSC::connectShared(const std::string &reader) {
+    return open(reader, "*", true);
+}
+
+LONG PCSC::open(const std::string &reader, const std::string &protocol, bool shared) {
+    _log_pcsc("Connecting to card in %s with %s", reader.c_str(), protocol.c_str());
     LONG err = SCARD_S_SUCCESS;
 
     // Create context, if not yet connected
@@ -77,11 +108,12 @@ LONG PCSC::connect(const std::string &reader, const std::string &protocol) {
 
     const PCSCReader *wanted = from_name(reader, readers);
     if (!wanted) {
-        _log("Reader %s not found from reader list", reader.c_str());
+        _log_warning(PCSC, "Reader %s not found from reader list", reader.c_str());
+        return SCARD_E_UNKNOWN_READER;
     }
 
     if (wanted->exclusive) {
-        _log("Can not connect to a reader used in exclusive mode");
+        _log_warning(PCSC, "Can not connect to a reader used in exclusive mode");
         return SCARD_E_SHARING_VIOLATION;
     }
 
@@ -99,13 +131,15 @@ LONG PCSC::connect(const std::string &reader, const std::string &protocol) {
 
     // TODO: Windows and exclusive access
     DWORD mode = SCARD_SHARE_SHARED;
-    if (wanted->inuse) {
+    if (shared) {
+        check_SCard(Connect, context, reader.c_str(), SCARD_SHARE_SHARED, proto, &card, &this->protocol);
+    } else if (wanted->inuse) {
 #ifdef _WIN32
         return SCARD_E_SHARING_VIOLATION; // FIXME: lots of UX love here
 #endif
         check_SCard(Connect, context, reader.c_str(), SCARD_SHARE_SHARED, proto, &card, &this->protocol);
     } else {
-        _log("Reader is not in use, assuming exclusive access is possible");
+        _log_pcsc("Reader is not in use, assuming exclusive access is possible");
         mode = SCARD_SHARE_EXCLUSIVE;
         // Try to connect multiple times, a freshly inserted card is often probed by other software as well
         int i = 0;
@@ -113,9 +147,7 @@ LONG PCSC::connect(const std::string &reader, const std::string &protocol) {
             err = SCard(Connect, context, reader.c_str(), mode, proto, &card, &this->protocol);
             if (err != SCARD_E_SHARING_VIOLATION)
                 break;
-#ifdef _WIN32
-            Sleep(300);
-#endif
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
             i++;
         } while (i < 3);
         if (err != SCARD_S_SUCCESS) {
@@ -123,9 +155,12 @@ LONG PCSC::connect(const std::string &reader, const std::string &protocol) {
         }
     }
 #ifndef _WIN32
-    check_SCard(BeginTransaction, card);
+    if (!shared) {
+        check_SCard(BeginTransaction, card);
+        transaction = true;
+    }
 #endif
-    _log("Connected to %s in %s mode, protocol %s", reader.c_str(), mode == SCARD_SHARE_EXCLUSIVE ? "exclusive" : "shared", this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    _log_pcsc("Connected to %s in %s mode, protocol %s", reader.c_str(), mode == SCARD_SHARE_EXCLUSIVE ? "exclusive" : "shared", this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
     status = *wanted;
     connected = true;
     return err;
@@ -138,11 +173,12 @@ LONG PCSC::wait(const std::string &reader, const std::string &protocol) {
 
     const PCSCReader *wanted = from_name(reader, readers);
     if (!wanted) {
-        _log("Reader %s not found from reader list", reader.c_str());
+        _log_warning(PCSC, "Reader %s not found from reader list", reader.c_str());
+        return SCARD_E_UNKNOWN_READER;
     }
 
     if (wanted->exclusive) {
-        _log("Can not connect to a reader used in exclusive mode");
+        _log_warning(PCSC, "Can not connect to a reader used in exclusive mode");
         return SCARD_E_SHARING_VIOLATION;
     }
 
@@ -171,15 +207,27 @@ LONG PCSC::wait(const std::string &reader, const std::string &protocol) {
 
 void PCSC::disconnect() {
     if (connected) {
-#ifndef _WIN32
         // No transactions on Windows due to the "5 second rule"
-        SCard(EndTransaction, card, SCARD_LEAVE_CARD);
-#endif
+        end();
         SCard(Disconnect, card, SCARD_RESET_CARD);
     }
     connected = false;
 }
 
+LONG PCSC::begin() {
+    if (transaction)
+        return SCARD_S_SUCCESS;
+    check_SCard(BeginTransaction, card);
+    transaction = true;
+    return SCARD_S_SUCCESS;
+}
+
+void PCSC::end() {
+    if (transaction)
+        SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+    transaction = false;
+}
+
 // Intended to be called from a different thread than the rest of the code
 LONG PCSC::cancel(SCARDCONTEXT ctx) {
     return SCard(Cancel, ctx);
@@ -187,7 +235,7 @@ LONG PCSC::cancel(SCARDCONTEXT ctx) {
 
 
 LONG PCSC::transmit(const std::vector<unsigned char> &apdu, std::vector<unsigned char> &response) {
-    _log("PCSC: sending %s", toHex(apdu).c_str());
+    _log_at(Logger::Trace, Logger::PCSC, "PCSC: sending %s", toHex(apdu).c_str());
 
     SCARD_IO_REQUEST req;
     req.dwProtocol = protocol;
@@ -199,7 +247,41 @@ LONG PCSC::transmit(const std::vector<unsigned char> &apdu, std::vector<unsigned
         return err;
     }
     response.resize(rlen);
-    _log("PCSC: received %s", toHex(response).c_str());
+    _log_at(Logger::Trace, Logger::PCSC, "PCSC: received %s", toHex(response).c_str());
+    return err;
+}
+
+LONG PCSC::transmit(const std::vector<std::vector<unsigned char>> &apdus, const std::vector<std::vector<unsigned char>> &expected, bool stop,
+                    std::vector<std::vector<unsigned char>> &responses, int &mismatch) {
+    _log_pcsc("PCSC: sending a batch of %zu APDUs", apdus.size());
+    mismatch = -1;
+#ifdef _WIN32
+    // Elsewhere the transaction is held for the lifetime of the connection
+    bool own = !transaction;
+    if (own)
+        check_SCard(BeginTransaction, card);
+#endif
+    LONG err = SCARD_S_SUCCESS;
+    std::vector<unsigned char> response;
+    for (size_t i = 0; i < apdus.size(); i++) {
+        response.resize(4096); // More than most APDU buffers on cards
+        err = transmit(apdus[i], response);
+        if (err != SCARD_S_SUCCESS)
+            break;
+        responses.push_back(response);
+        if (!stop || i >= expected.size() || expected[i].empty())
+            continue;
+        const std::vector<unsigned char> &sw = expected[i];
+        if (response.size() < sw.size() || !std::equal(sw.begin(), sw.end(), response.end() - sw.size())) {
+            _log_pcsc("PCSC: unexpected status word for APDU %zu, stopping", i);
+            mismatch = int(i);
+            break;
+        }
+    }
+#ifdef _WIN32
+    if (own)
+        SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+#endif
     return err;
 }
 
@@ -212,6 +294,184 @@ PCSC::~PCSC() {
     }
 }
 
+// Owns a PC/SC context for the lifetime of the process and keeps a snapshot
+// of all readers up to date. The thread sleeps in SCardGetStatusChange,
+// including the PnP pseudo-reader for reader hotplug where supported.
+class ReaderMonitor {
+public:
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (thread.joinable())
+            return;
+        stopping = false;
+        finished = false;
+        thread = std::thread(&ReaderMonitor::run, this);
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!thread.joinable())
+                return;
+            stopping = true;
+            changed.notify_all();
+            // Repeat, in case the thread was just about to start waiting
+            while (!finished) {
+                if (established)
+                    PCSC::cancel(context);
+                changed.wait_for(lock, std::chrono::milliseconds(100));
+            }
+        }
+        thread.join();
+        std::atomic_store(&current, std::shared_ptr<const std::vector<PCSCReader>>());
+    }
+
+    bool running() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return thread.joinable();
+    }
+
+    // Returns null if the monitor is not running
+    std::shared_ptr<const std::vector<PCSCReader>> snapshot() {
+        std::shared_ptr<const std::vector<PCSCReader>> readers = std::atomic_load(&current);
+        if (readers || !running())
+            return readers;
+        // Wait for the first enumeration to finish
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_for(lock, std::chrono::seconds(5), [this] { return std::atomic_load(&current) || stopping; });
+        return std::atomic_load(&current);
+    }
+
+    std::atomic<unsigned long> generation{0};
+
+private:
+    static bool same(const std::vector<PCSCReader> &a, const std::vector<PCSCReader> &b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const PCSCReader &x, const PCSCReader &y) {
+            return x.name == y.name && x.atr == y.atr && x.inuse == y.inuse && x.exclusive == y.exclusive;
+        });
+    }
+
+    void publish(std::vector<PCSCReader> &&readers) {
+        std::shared_ptr<const std::vector<PCSCReader>> previous = std::atomic_load(&current);
+        if (previous && same(*previous, readers))
+            return;
+        std::atomic_store(&current, std::shared_ptr<const std::vector<PCSCReader>>(new std::vector<PCSCReader>(std::move(readers))));
+        generation++;
+        std::lock_guard<std::mutex> lock(mutex);
+        changed.notify_all();
+    }
+
+    // Returns false if the monitor is stopped while waiting
+    bool pause(int seconds) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return !changed.wait_for(lock, std::chrono::seconds(seconds), [this] { return stopping; });
+    }
+
+    void run() {
+        bool pnp = true;
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping)
+                    break;
+                if (!established) {
+                    established = SCard(EstablishContext, SCARD_SCOPE_USER, nullptr, nullptr, &context) == SCARD_S_SUCCESS;
+                }
+            }
+            if (!established) {
+                publish({});
+                if (!pause(1))
+                    break;
+                continue;
+            }
+            std::vector<PCSCReader> readers = PCSC::readerList(context);
+
+            // Wait for a change in any of the readers or the reader list
+            std::vector<SCARD_READERSTATE> states(readers.size());
+            for (size_t i = 0; i < readers.size(); i++) {
+                states[i].szReader = readers[i].name.c_str();
+                states[i].dwCurrentState = readers[i].state.dwEventState;
+                states[i].dwEventState = SCARD_STATE_UNAWARE;
+            }
+            if (pnp) {
+                SCARD_READERSTATE notification;
+                notification.szReader = "\\\\?PnP?\\Notification";
+                // pcsc-lite keeps the reader count in the upper word
+                notification.dwCurrentState = DWORD(readers.size() << 16);
+                notification.dwEventState = SCARD_STATE_UNAWARE;
+                states.push_back(notification);
+            }
+            publish(std::move(readers));
+            if (states.empty()) {
+                if (!pause(1))
+                    break;
+                continue;
+            }
+
+            // Without PnP notifications new readers are noticed by polling
+            LONG err = SCard(GetStatusChange, context, pnp ? INFINITE : 1000, states.data(), DWORD(states.size()));
+            if (err == SCARD_S_SUCCESS || err == LONG(SCARD_E_TIMEOUT)) {
+                continue;
+            }
+            if (err == LONG(SCARD_E_CANCELLED)) {
+                continue; // stopping is checked above
+            }
+            if (pnp && (err == LONG(SCARD_E_UNKNOWN_READER) || err == LONG(SCARD_E_INVALID_PARAMETER))) {
+                _log_pcsc("PnP notifications not supported, polling for new readers");
+                pnp = false;
+                continue;
+            }
+            if (err == LONG(SCARD_E_NO_READERS_AVAILABLE)) {
+                if (!pause(1))
+                    break;
+                continue;
+            }
+            // pcscd went away, establish a new context
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                SCard(ReleaseContext, context);
+                established = false;
+            }
+            if (!pause(1))
+                break;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (established) {
+            SCard(ReleaseContext, context);
+            established = false;
+        }
+        finished = true;
+        changed.notify_all();
+    }
+
+    std::mutex mutex; // protects context and stopping
+    std::condition_variable changed;
+    std::thread thread;
+    SCARDCONTEXT context;
+    bool established = false;
+    bool stopping = false;
+    bool finished = false;
+    std::shared_ptr<const std::vector<PCSCReader>> current;
+};
+
+// Never destroyed, the thread may still be blocked in PC/SC when the process exits
+static ReaderMonitor &monitor() {
+    static ReaderMonitor *instance = new ReaderMonitor();
+    return *instance;
+}
+
+void PCSC::startMonitor() {
+    monitor().start();
+}
+
+void PCSC::stopMonitor() {
+    monitor().stop();
+}
+
+unsigned long PCSC::generation() {
+    return monitor().generation;
+}
+
 // TODO: get rid of this
 std::vector<std::vector<unsigned char>> PCSC::atrList() {
     std::vector<std::vector<unsigned char>> result;
@@ -225,6 +485,11 @@ std::vector<std::vector<unsigned char>> PCSC::atrList() {
 
 
 std::vector<PCSCReader> PCSC::readerList(SCARDCONTEXT ctx) {
+    if (!ctx) {
+        std::shared_ptr<const std::vector<PCSCReader>> snapshot = monitor().snapshot();
+        if (snapshot)
+            return *snapshot;
+    }
     std::vector<PCSCReader> result;
     SCARDCONTEXT hContext;
     LONG err = SCARD_S_SUCCESS;
@@ -240,7 +505,7 @@ std::vector<PCSCReader> PCSC::readerList(SCARDCONTEXT ctx) {
     DWORD size;
     err = SCard(ListReaders, hContext, nullptr, nullptr, &size);
     if (err != SCARD_S_SUCCESS || !size) {
-        _log("SCardListReaders: %s %d", errorName(err), size);
+        _log_pcsc("SCardListReaders: %s %lu", errorName(err), (unsigned long)size);
         if (!ctx)
             SCard(ReleaseContext, hContext);
         return result;
@@ -287,11 +552,11 @@ std::vector<PCSCReader> PCSC::readerList(SCARDCONTEXT ctx) {
         bool inuse = i.dwEventState & SCARD_STATE_INUSE;
         bool exclusive = i.dwEventState & SCARD_STATE_EXCLUSIVE;
         bool mute = i.dwEventState & SCARD_STATE_MUTE;
-        _log("found reader: %s", reader.c_str());
-        _log("  exclusive:%s inuse:%s mute:%s", exclusive?"true":"false", inuse?"true":"false", mute?"true":"false");
+        _log_pcsc("found reader: %s", reader.c_str());
+        _log_pcsc("  exclusive:%s inuse:%s mute:%s", exclusive?"true":"false", inuse?"true":"false", mute?"true":"false");
         std::vector<unsigned char> atr(i.rgbAtr, i.rgbAtr + i.cbAtr);
         if (!atr.empty()) {
-            _log("  atr:%s", toHex(atr).c_str());
+            _log_pcsc("  atr:%s", toHex(atr).c_str());
         }
         result.push_back({reader, atr, inuse, exclusive, i});
     }
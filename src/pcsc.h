@@ -39,13 +39,30 @@ struct PCSCReader {
 
 class PCSC {
 public:
+    // Without a context, both return the latest snapshot of the reader monitor, if started
     static std::vector<std::vector<unsigned char>> atrList();
     static std::vector<PCSCReader> readerList(SCARDCONTEXT ctx = 0);
     static LONG cancel(SCARDCONTEXT ctx);
 
+    // The reader monitor owns a long-lived context and keeps a snapshot
+    // of the readers and cards up to date by waiting for PC/SC events.
+    static void startMonitor();
+    static void stopMonitor();
+    // Changes whenever a reader or a card comes or goes
+    static unsigned long generation();
+
     LONG connect(const std::string &reader, const std::string &protocol = "*");
+    // Shared and without a transaction, for short reads that must not keep
+    // others off the card. The reads go between begin() and end().
+    LONG connectShared(const std::string &reader);
+    LONG begin();
+    void end();
     LONG wait(const std::string &reader, const std::string &protocol = "*");
     LONG transmit(const std::vector<unsigned char> &apdu, std::vector<unsigned char> &response);
+    // Sends APDUs back to back, stopping at the first response that does not end with the expected status word.
+    // mismatch is the index of the APDU that stopped the batch, -1 if none
+    LONG transmit(const std::vector<std::vector<unsigned char>> &apdus, const std::vector<std::vector<unsigned char>> &expected, bool stop,
+                  std::vector<std::vector<unsigned char>> &responses, int &mismatch);
     void disconnect();
 
     PCSCReader getStatus(); // XXX
@@ -56,7 +73,9 @@ public:
 private:
     bool established = false;
     bool connected = false;
+    bool transaction = false;
     SCARDCONTEXT context;
     SCARDHANDLE card;
     PCSCReader status;
+    LONG open(const std::string &reader, const std::string &protocol, bool shared);
 };
@@ -20,22 +20,23 @@
 #include "pkcs11module.h"
 #include "Logger.h"
 #include "util.h"
+#include "certcache.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <string>
 #include <stdexcept>
+#include <system_error>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 
-#include <QSslCertificate>
-#include <QSslCertificateExtension>
-#include <QByteArray>
-#include <QJsonDocument>
-#include <QMetaType>
-#include <QList>
-
 #ifndef _WIN32
 #include <dlfcn.h>
 #endif
@@ -43,12 +44,30 @@
 // TODO: update to PKCS#11 v2.30 header
 #define CKR_LIBRARY_LOAD_FAILED               0x000001B7
 
+// Results that are part of normal operation, not worth a warning
+static bool routine(CK_RV rv) {
+    switch (rv) {
+    case CKR_OK:
+    case CKR_BUFFER_TOO_SMALL:
+    case CKR_CANT_LOCK:
+    case CKR_CRYPTOKI_ALREADY_INITIALIZED:
+    case CKR_FUNCTION_NOT_SUPPORTED:
+    case CKR_NO_EVENT:
+    case CKR_USER_ALREADY_LOGGED_IN:
+        return true;
+    default:
+        return false;
+    }
+}
+
 // Wrapper around a single PKCS#11 module
 template <typename Func, typename... Args>
 CK_RV Call(const char *fun, const char *file, int line, const char *function, Func func, Args... args)
 {
     CK_RV rv = func(args...);
-    Logger::writeLog(fun, file, line, "%s: %s", function, PKCS11Module::errorName(rv));
+    Logger::Level level = routine(rv) ? Logger::Debug : Logger::Warning;
+    if (LOG_ENABLED(level, Logger::P11))
+        Logger::writeLog(fun, file, line, "%s: %s", function, PKCS11Module::errorName(rv));
     return rv;
 }
 #define C(API, ...) Call(__FUNCTION__, __FILE__, __LINE__, "C_"#API, fl->C_##API, __VA_ARGS__)
@@ -57,101 +76,213 @@ CK_RV Call(const char *fun, const char *file, int line, const char *function, Fu
 #define check_C(API, ...) do { \
     CK_RV _ret = Call(__FUNCTION__, __FILE__, __LINE__, "C_"#API, fl->C_##API, __VA_ARGS__); \
     if (_ret != CKR_OK) { \
-       Logger::writeLog(__FUNCTION__, __FILE__, __LINE__, "returning %s", PKCS11Module::errorName(_ret)); \
+       _log_at(Logger::Debug, Logger::P11, "returning %s", PKCS11Module::errorName(_ret)); \
        return _ret; \
     } \
 } while(0)
 
+static CK_ULONG initialPageSize() {
+    const char *env = getenv("WEB_EID_P11_PAGE_SIZE");
+    long size = env ? strtol(env, nullptr, 10) : 0;
+    return size > 0 ? CK_ULONG(size) : 32;
+}
+
+CK_ULONG PKCS11Module::pageSize = initialPageSize();
+
+static int initialLoginTimeout() {
+    const char *env = getenv("WEB_EID_LOGIN_TIMEOUT");
+    return env ? atoi(env) : 0;
+}
+
+int PKCS11Module::loginTimeout = initialLoginTimeout();
+
+// Tokens are read by at most this many threads at a time
+static const size_t MAX_WORKERS = 8;
+
+static size_t initialSignWorkers() {
+    const char *env = getenv("WEB_EID_SIGN_WORKERS");
+    long workers = env ? strtol(env, nullptr, 10) : 0;
+    return workers > 0 ? size_t(workers) : MAX_WORKERS;
+}
+
+size_t PKCS11Module::signWorkers = initialSignWorkers();
+
+// How a hash is signed with a key of each type. RSA signs the DigestInfo,
+// ECDSA the bare hash.
+struct SignatureScheme {
+    HashAlgorithm hash;
+    CK_KEY_TYPE keyType;
+    CK_MECHANISM_TYPE mechanism;
+    size_t hashLength;
+    size_t prefixLength;
+    unsigned char prefix[19];
+};
+
+static constexpr SignatureScheme SCHEMES[] = {
+    {Sha1Hash, CKK_RSA, CKM_RSA_PKCS, 20, 15, {0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14}},
+    {Sha224Hash, CKK_RSA, CKM_RSA_PKCS, 28, 19, {0x30, 0x2d, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x04, 0x05, 0x00, 0x04, 0x1c}},
+    {Sha256Hash, CKK_RSA, CKM_RSA_PKCS, 32, 19, {0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20}},
+    {Sha384Hash, CKK_RSA, CKM_RSA_PKCS, 48, 19, {0x30, 0x41, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00, 0x04, 0x30}},
+    {Sha512Hash, CKK_RSA, CKM_RSA_PKCS, 64, 19, {0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40}},
+    {Sha1Hash, CKK_EC, CKM_ECDSA, 20, 0, {}},
+    {Sha224Hash, CKK_EC, CKM_ECDSA, 28, 0, {}},
+    {Sha256Hash, CKK_EC, CKM_ECDSA, 32, 0, {}},
+    {Sha384Hash, CKK_EC, CKM_ECDSA, 48, 0, {}},
+    {Sha512Hash, CKK_EC, CKM_ECDSA, 64, 0, {}},
+};
+
+static const size_t MAX_HASH = 64;
+static const size_t MAX_PREFIX = sizeof(SCHEMES[0].prefix);
+// RSA 8192
+static const size_t MAX_SIGNATURE = 1024;
+
+// Null if the hash does not have the length of the algorithm
+static const SignatureScheme *signatureScheme(HashAlgorithm hash, CK_KEY_TYPE keyType, size_t hashLength) {
+    for (const SignatureScheme &scheme: SCHEMES) {
+        if (scheme.keyType == keyType && scheme.hashLength == hashLength && (hash == UnknownHash || scheme.hash == hash))
+            return &scheme;
+    }
+    return nullptr;
+}
+
+// Named curves by the DER of their OID, as in CKA_EC_PARAMS
+struct Curve {
+    size_t length;
+    unsigned char oid[11];
+    int bits;
+};
+
+static constexpr Curve CURVES[] = {
+    {10, {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07}, 256}, // P-256
+    {7, {0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22}, 384}, // P-384
+    {7, {0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x23}, 521}, // P-521
+    {11, {0x06, 0x09, 0x2b, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x07}, 256}, // brainpoolP256r1
+    {11, {0x06, 0x09, 0x2b, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x0b}, 384}, // brainpoolP384r1
+    {11, {0x06, 0x09, 0x2b, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x0d}, 512}, // brainpoolP512r1
+};
+
+static int curveBits(const std::vector<unsigned char> &params) {
+    for (const Curve &curve: CURVES) {
+        if (params.size() == curve.length && memcmp(params.data(), curve.oid, curve.length) == 0)
+            return curve.bits;
+    }
+    return 0;
+}
+
+// Runs task(0) ... task(count - 1) on up to workers threads, the calling
+// thread included
+template <typename Task>
+static void parallel(size_t count, size_t workers, Task task) {
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i; (i = next++) < count;)
+            task(i);
+    };
+    std::vector<std::thread> threads;
+    for (size_t n = 1; n < std::min(count, workers); n++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &thread: threads)
+        thread.join();
+}
+
 std::vector<unsigned char> PKCS11Module::attribute(CK_ATTRIBUTE_TYPE type, CK_SESSION_HANDLE sid, CK_OBJECT_HANDLE obj) const
 {
     CK_ATTRIBUTE attr = {type, nullptr, 0};
-    C(GetAttributeValue, sid, obj, &attr, 1UL);
+    // Missing attributes come back as CK_UNAVAILABLE_INFORMATION
+    if (C(GetAttributeValue, sid, obj, &attr, 1UL) != CKR_OK || attr.ulValueLen == CK_UNAVAILABLE_INFORMATION)
+        return std::vector<unsigned char>();
     std::vector<unsigned char> data(attr.ulValueLen, 0);
     attr.pValue = data.data();
     C(GetAttributeValue, sid, obj, &attr, 1UL);
     return data;
 }
 
+// Reads several attributes of an object. Buffers big enough for a typical
+// certificate are offered right away, so that a single call usually does it.
+std::vector<std::vector<unsigned char>> PKCS11Module::attributes(const std::vector<CK_ATTRIBUTE_TYPE> &types, CK_SESSION_HANDLE sid, CK_OBJECT_HANDLE obj) const
+{
+    static const CK_ULONG GUESS = 4096;
+    std::vector<std::vector<unsigned char>> values(types.size(), std::vector<unsigned char>(GUESS));
+    std::vector<CK_ATTRIBUTE> attrs(types.size());
+    for (size_t i = 0; i < types.size(); i++)
+        attrs[i] = {types[i], values[i].data(), GUESS};
+    CK_RV rv = C(GetAttributeValue, sid, obj, attrs.data(), CK_ULONG(attrs.size()));
+    if (rv == CKR_BUFFER_TOO_SMALL) {
+        // Ask for the sizes and try again
+        for (CK_ATTRIBUTE &attr: attrs) {
+            attr.pValue = nullptr;
+            attr.ulValueLen = 0;
+        }
+        C(GetAttributeValue, sid, obj, attrs.data(), CK_ULONG(attrs.size()));
+        for (size_t i = 0; i < types.size(); i++) {
+            if (attrs[i].ulValueLen == CK_UNAVAILABLE_INFORMATION)
+                attrs[i].ulValueLen = 0;
+            values[i].resize(attrs[i].ulValueLen);
+            attrs[i].pValue = values[i].data();
+        }
+        rv = C(GetAttributeValue, sid, obj, attrs.data(), CK_ULONG(attrs.size()));
+    }
+    // Attributes that could not be read are left empty
+    bool valid = rv == CKR_OK || rv == CKR_ATTRIBUTE_SENSITIVE || rv == CKR_ATTRIBUTE_TYPE_INVALID;
+    for (size_t i = 0; i < types.size(); i++)
+        values[i].resize(valid && attrs[i].ulValueLen != CK_UNAVAILABLE_INFORMATION ? attrs[i].ulValueLen : 0);
+    return values;
+}
+
 std::vector<CK_OBJECT_HANDLE> PKCS11Module::objects(CK_OBJECT_CLASS objectClass, CK_SESSION_HANDLE session, CK_ULONG count) const
 {
     return objects({ {CKA_CLASS, &objectClass, sizeof(objectClass)} }, session, count);
 }
 
+// Finds up to count objects, or all of them if count is 0, a page at a time
 std::vector<CK_OBJECT_HANDLE> PKCS11Module::objects(const std::vector<CK_ATTRIBUTE> &attr, CK_SESSION_HANDLE session, CK_ULONG count) const
 {
-    C(FindObjectsInit, session, const_cast<CK_ATTRIBUTE*>(attr.data()), CK_ULONG(attr.size()));
-    CK_ULONG objectCount = count;
-    std::vector<CK_OBJECT_HANDLE> objects(objectCount);
-    C(FindObjects, session, objects.data(), objects.size(), &objectCount);
+    std::vector<CK_OBJECT_HANDLE> objects;
+    if (C(FindObjectsInit, session, const_cast<CK_ATTRIBUTE*>(attr.data()), CK_ULONG(attr.size())) != CKR_OK)
+        return objects;
+    for (;;) {
+        CK_ULONG wanted = count ? std::min<CK_ULONG>(pageSize, count - objects.size()) : pageSize;
+        CK_ULONG found = 0;
+        size_t offset = objects.size();
+        objects.resize(offset + wanted);
+        if (C(FindObjects, session, objects.data() + offset, wanted, &found) != CKR_OK)
+            found = 0;
+        objects.resize(offset + found);
+        if (found < wanted || objects.size() == count)
+            break;
+    }
     C(FindObjectsFinal, session);
-    objects.resize(objectCount);
     return objects;
 }
 
 std::vector<CK_OBJECT_HANDLE> PKCS11Module::getKey(CK_SESSION_HANDLE session, const std::vector<unsigned char> &id) const {
-    _log("Looking for key with id %s length %d", toHex(id).c_str(), id.size());
+    _log_p11("Looking for key with id %s length %zu", toHex(id).c_str(), id.size());
     CK_OBJECT_CLASS keyclass = CKO_PRIVATE_KEY;
     return objects({
         {CKA_CLASS, &keyclass, sizeof(keyclass)},
         {CKA_ID, (void*)id.data(), id.size()}
-    }, session, 1);
+    }, session, 2); // two, so that an ambiguous ID is noticed
 }
 
-
-// TODO: move this to QtPKI
-static bool usage_matches(const std::vector<unsigned char> &certificateCandidate, CertificatePurpose type)
-{
-    QSslCertificate cert = v2cert(certificateCandidate);
-    bool isCa = true;
-    bool isSSLClient = false;
-    bool isNonRepudiation = false;
-
-    for (const QSslCertificateExtension &ext: cert.extensions()) {
-        QVariant v = ext.value();
-//      _log("ext: %s", ext.name().toStdString().c_str());
-        if (ext.name() == "basicConstraints") {
-            QVariantMap m = ext.value().toMap();
-            isCa = m.value("ca").toBool();
-        } else if (ext.oid() == "2.5.29.37") {
-            // 2.5.29.37 - extendedKeyUsage
-            // XXX: these are not declared stable by Qt.
-            // Linux returns parsed map (OpenSSL?) OSX 5.8 returns QByteArrays, 5.5 works
-            if (v.canConvert<QByteArray>()) {
-                // XXX: this is 06082b06010505070302 what is 1.3.6.1.5.5.7.3.2 what is "TLS Client"
-                if (v.toByteArray().toHex().contains("06082b06010505070302")) {
-                    isSSLClient = true;
-                }
-            } else if (v.canConvert<QList<QVariant>>()) {
-                // Linux
-                if (v.toList().contains("TLS Web Client Authentication")) {
-                    isSSLClient = true;
-                }
-            }
-        } else if (ext.name() == "keyUsage") {
-            if (v.canConvert<QList<QVariant>>()) {
-                // Linux
-                if (v.toList().contains("Non Repudiation")) {
-                    isNonRepudiation = true;
-                }
-            }
-            // FIXME: detect NR from byte array
-            // Do a ugly trick for esteid only
-            QList<QString> ou = cert.subjectInfo(QSslCertificate::OrganizationalUnitName);
-            if (!isNonRepudiation && ou.size() > 0 && ou.at(0) == "digital signature") {
-                isNonRepudiation = true;
-            }
-            _log("keyusage: %s", v.toByteArray().toHex().toStdString().c_str());
-        }
-    }
-    _log("Certificate flags: ca=%d auth=%d nonrepu=%d", isCa, isSSLClient, isNonRepudiation);
-    return !isCa &&
-           ((type & Authentication && isSSLClient) || (type & Signing && isNonRepudiation));
+// Tokens that hide the private key until login get the type from the certificate
+CK_KEY_TYPE PKCS11Module::keyType(CK_SESSION_HANDLE session, const std::vector<unsigned char> &id, const CertificateInfo &info) const {
+    std::vector<CK_OBJECT_HANDLE> key = getKey(session, id);
+    std::vector<unsigned char> type = key.empty() ? std::vector<unsigned char>() : attribute(CKA_KEY_TYPE, session, key[0]);
+    if (type.size() == sizeof(CK_KEY_TYPE))
+        return *(const CK_KEY_TYPE *)type.data();
+    return info.keyType == EcKey ? CKK_EC : CKK_RSA;
 }
 
 
 CK_RV PKCS11Module::load(const std::string &module) {
-    // Clear any present modules
-    certs.clear();
+    if (library && path == module) {
+        if (enumerated && !changed())
+            return CKR_OK;
+        return refresh();
+    }
+    unload();
+    path = module;
     CK_C_GetFunctionList C_GetFunctionList = nullptr;
 #ifdef _WIN32
     library = LoadLibraryA(module.c_str());
@@ -166,9 +297,9 @@ CK_RV PKCS11Module::load(const std::string &module) {
             std::vector<char> path(1024, 0);
             if (dlinfo(library,  RTLD_DI_ORIGIN, path.data()) == 0) {
                 std::string p(path.begin(), path.end());
-                _log("Loaded %s from %s", module.c_str(), p.c_str());
+                _log_p11("Loaded %s from %s", module.c_str(), p.c_str());
             } else {
-                _log("Warning: could not get library load path");
+                _log_warning(P11, "Could not get library load path");
             }
         }
 #endif
@@ -177,167 +308,672 @@ CK_RV PKCS11Module::load(const std::string &module) {
 #endif
 
     if (!C_GetFunctionList) {
-        _log("Module does not have C_GetFunctionList");
+        _log_error(P11, "Module %s does not have C_GetFunctionList", path.c_str());
+        unload();
         return CKR_LIBRARY_LOAD_FAILED; // XXX Not really what we had in mind according to spec spec, but usable.
     }
     Call(__FUNCTION__, __FILE__, __LINE__, "C_GetFunctionList", C_GetFunctionList, &fl);
-    CK_RV rv = C(Initialize, nullptr);
+    // Let the module use native locks, so that slots can be read concurrently
+    CK_C_INITIALIZE_ARGS args = {};
+    args.flags = CKF_OS_LOCKING_OK;
+    CK_RV rv = C(Initialize, &args);
+    // Whoever initialized the module first may not have asked for locking
+    threadsafe = rv == CKR_OK;
+    if (rv == CKR_CANT_LOCK) {
+        _log_p11("Module can not lock, reading slots one by one");
+        rv = C(Initialize, nullptr);
+    }
     if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
+        _log_error(P11, "C_Initialize of %s failed: %s", path.c_str(), errorName(rv));
+        unload();
         return rv;
     } else {
         initialized = rv != CKR_CRYPTOKI_ALREADY_INITIALIZED;
     }
+    return refresh();
+}
+
+// Drains the slot events the module has queued up, without blocking
+bool PKCS11Module::changed() {
+    bool result = false;
+    CK_SLOT_ID slot;
+    // Bounded, in case a module keeps reporting the same event
+    for (int i = 0; i < 16; i++) {
+        CK_RV rv = C(WaitForSlotEvent, CKF_DONT_BLOCK, &slot, nullptr);
+        if (rv != CKR_OK)
+            break;
+        _log_p11("Slot event in slot %lu", slot);
+        result = true;
+    }
+    return result;
+}
+
+void PKCS11Module::unload() {
+    certs.clear();
+    enumerated = false;
+    closeSessions();
+    if (initialized)
+        C(Finalize, nullptr);
+    initialized = false;
+    fl = nullptr;
+    if (!library)
+        return;
+#ifdef _WIN32
+    FreeLibrary(library);
+#else
+    dlclose(library);
+#endif
+    library = 0;
+}
+
+// Reads the certificates of one slot, may run concurrently with other slots
+// Labels are shown to the user: whitespace is trimmed and runs of it,
+// including the padding of some modules with zeros, become a single space
+static std::string simplified(const CK_UTF8CHAR *text, size_t size) {
+    std::string result;
+    bool space = false;
+    for (size_t i = 0; i < size; i++) {
+        char c = char(text[i]);
+        if (c == '\0' || isspace((unsigned char)c)) {
+            space = !result.empty();
+            continue;
+        }
+        if (space)
+            result += ' ';
+        space = false;
+        result += c;
+    }
+    return result;
+}
+
+void PKCS11Module::enumerate(CK_SLOT_ID slot, std::vector<std::pair<Fingerprint, P11Certificate>> &found) const {
+    // Check the content of the slot
+    CK_TOKEN_INFO token;
+    CK_SESSION_HANDLE sid = 0;
+    _log_p11("Checking slot %lu", slot);
+    CK_RV rv = C(GetTokenInfo, slot, &token);
+    if (rv != CKR_OK) {
+        _log_warning(P11, "Could not get token info, skipping slot %lu", slot);
+        return;
+    }
+    std::string label = simplified(token.label, sizeof(token.label));
+    _log_p11("Token has a label: \"%s\"", label.c_str());
+    P11Token info({(int)token.ulMinPinLen, (int)token.ulMaxPinLen, label, (bool)(token.flags & CKF_PROTECTED_AUTHENTICATION_PATH), slot, token.flags, token.ulMaxSessionCount});
+
+    rv = C(OpenSession, slot, CKF_SERIAL_SESSION, nullptr, nullptr, &sid);
+    if (rv != CKR_OK) {
+        _log_warning(P11, "Could not open session, skipping slot %lu", slot);
+        return;
+    }
+    _log_p11("Opened session: %lu", sid);
+    // CK_OBJECT_CLASS objectClass
+    std::vector<CK_OBJECT_HANDLE> objectHandle = objects(CKO_CERTIFICATE, sid, 0);
+    // We now have the certificate handles (valid for this session) in objectHandle
+    _log_p11("Found %zu certificates from slot %lu", objectHandle.size(), slot);
+
+    // The certificates of a token that was seen before are not read again,
+    // if it still has as many of them and the first one is among them
+    std::string cacheKey = tokenKey(token);
+    std::vector<CachedCertificate> cached;
+    if (!cacheKey.empty() && CertificateCache::find(cacheKey, cached)) {
+        bool current = cached.size() == objectHandle.size();
+        if (current) {
+            std::vector<unsigned char> first = attributes({CKA_VALUE}, sid, objectHandle[0])[0];
+            current = std::any_of(cached.begin(), cached.end(), [&](const CachedCertificate &cert) {
+                return cert.der == first;
+            });
+        }
+        if (current) {
+            _log_p11("Using %zu cached certificates of slot %lu", cached.size(), slot);
+            for (const CachedCertificate &cert: cached) {
+                P11Certificate entry;
+                entry.token = info;
+                entry.id = cert.id;
+                entry.info = CertificateStore::add(cert.der);
+                entry.keyType = cert.keyType;
+                entry.cacheKey = cacheKey;
+                found.push_back(std::make_pair(entry.info->fingerprint, entry));
+            }
+            C(CloseSession, sid);
+            return;
+        }
+        _log_p11("Cached certificates of slot %lu are out of date", slot);
+        CertificateCache::forget(cacheKey);
+        cached.clear();
+    }
+    for (CK_OBJECT_HANDLE handle: objectHandle) {
+        // Get DER and certificate ID
+        std::vector<std::vector<unsigned char>> values = attributes({CKA_VALUE, CKA_ID}, sid, handle);
+        if (values[0].empty()) {
+            _log_warning(P11, "Could not read certificate %lu, skipping", handle);
+            continue;
+        }
+        // the certificate is parsed only once
+        P11Certificate entry;
+        entry.token = info;
+        entry.id = values[1];
+        entry.info = CertificateStore::add(values[0]);
+        entry.keyType = keyType(sid, entry.id, *entry.info);
+        entry.cacheKey = cacheKey;
+        _log_p11("Found %s certificate: %s %s", entry.keyType == CKK_EC ? "EC" : "RSA", entry.info->subject().c_str(), toHex(entry.id).c_str());
+        found.push_back(std::make_pair(entry.info->fingerprint, entry));
+        CachedCertificate cert;
+        cert.id = entry.id;
+        cert.keyType = entry.keyType;
+        cert.der = entry.info->der;
+        cached.push_back(cert);
+    }
+    // Close session with this slot. We ignore errors here
+    C(CloseSession, sid);
+    // Only a complete picture of the token is cached
+    if (!cacheKey.empty() && !cached.empty() && cached.size() == objectHandle.size())
+        CertificateCache::store(cacheKey, cached);
+}
+
+// Space padded, some modules pad with zeros instead
+static std::string padded(const CK_UTF8CHAR *text, size_t size) {
+    std::string result((const char *)text, size);
+    size_t end = result.find_last_not_of(std::string(" \0", 2));
+    return end == std::string::npos ? std::string() : result.substr(0, end + 1);
+}
+
+// Identifies the token for CertificateCache, empty if it has no serial number
+std::string PKCS11Module::tokenKey(const CK_TOKEN_INFO &token) const {
+    std::string serial = padded(token.serialNumber, sizeof(token.serialNumber));
+    if (serial.empty())
+        return serial;
+    return path + "|" + padded(token.manufacturerID, sizeof(token.manufacturerID)) + "|" + padded(token.model, sizeof(token.model)) + "|" + serial;
+}
+
+CK_RV PKCS11Module::refresh() {
+    certs.clear();
+    enumerated = false;
+    // Handles from before the event may point to a removed token
+    closeSessions();
+    // Events that happened before this enumeration are seen by it
+    changed();
 
     // Locate all slots with tokens
     std::vector<CK_SLOT_ID> slots_with_tokens;
     CK_ULONG slotCount = 0;
     check_C(GetSlotList, CK_TRUE, nullptr, &slotCount);
-    _log("slotCount = %i", slotCount);
+    _log_p11("slotCount = %lu", slotCount);
     slots_with_tokens.resize(slotCount);
     check_C(GetSlotList, CK_TRUE, slots_with_tokens.data(), &slotCount);
-    for (auto slot: slots_with_tokens) {
-        // Check the content of the slot
-        CK_TOKEN_INFO token;
-        CK_SESSION_HANDLE sid = 0;
-        _log("Checking slot %u", slot);
-        rv = C(GetTokenInfo, slot, &token);
-        if (rv != CKR_OK) {
-            _log("Could not get token info, skipping slot %u", slot);
-            continue;
-        }
-        std::string label = QString::fromUtf8((const char* )token.label, sizeof(token.label)).simplified().toStdString();
-        _log("Token has a label: \"%s\"", label.c_str());
-        C(OpenSession, slot, CKF_SERIAL_SESSION, nullptr, nullptr, &sid);
-        if (rv != CKR_OK) {
-            _log("Could not open session, skipping slot %u", slot);
-            continue;
-        }
-        _log("Opened session: %u", sid);
-        // CK_OBJECT_CLASS objectClass
-        std::vector<CK_OBJECT_HANDLE> objectHandle = objects(CKO_CERTIFICATE, sid, 2);
-        // We now have the certificate handles (valid for this session) in objectHandle
-        _log("Found %u certificates from slot %u", objectHandle.size(), slot);
-        for (CK_OBJECT_HANDLE handle: objectHandle) {
-            // Get DER
-            std::vector<unsigned char> certCandidate = attribute(CKA_VALUE, sid, handle);
-            // Get certificate ID
-            std::vector<unsigned char> certid = attribute(CKA_ID, sid, handle);
-            _log("Found certificate: %s %s", x509subject(certCandidate).c_str(), toHex(certid).c_str());
-            // add to map
-            certs[certCandidate] = std::make_pair(P11Token({(int)token.ulMinPinLen, (int)token.ulMaxPinLen, label, (bool)(token.flags & CKF_PROTECTED_AUTHENTICATION_PATH), slot, token.flags}), certid);
-        }
-        // Close session with this slot. We ignore errors here
-        C(CloseSession, sid);
+    slots_with_tokens.resize(slotCount);
+
+    // Slots are read concurrently if the module does its own locking,
+    // and merged in slot order
+    std::vector<std::vector<std::pair<Fingerprint, P11Certificate>>> found(slots_with_tokens.size());
+    parallel(slots_with_tokens.size(), threadsafe ? MAX_WORKERS : 1, [&](size_t i) {
+        enumerate(slots_with_tokens[i], found[i]);
+    });
+    for (const auto &slot: found) {
+        for (const auto &cert: slot)
+            certs.insert(cert);
     }
     // List all found certs
-    _log("found %d certificates", certs.size());
+    _log_p11("found %zu certificates", certs.size());
     for(const auto &cpairs : certs) {
-        auto location = cpairs.second;
-        _log("certificate: %s in slot %d with id %s", x509subject(cpairs.first).c_str(), location.first.slot, toHex(location.second).c_str());
+        const P11Certificate &location = cpairs.second;
+        _log_p11("certificate: %s in slot %lu with id %s", location.info->subject().c_str(), location.token.slot, toHex(location.id).c_str());
     }
+    enumerated = true;
     return CKR_OK;
 }
 
-std::vector<std::vector <unsigned char>> PKCS11Module::getCerts(CertificatePurpose type) {
-    std::vector<std::vector<unsigned char>> res;
+std::vector<CertificateInfo> PKCS11Module::getCerts(CertificatePurpose type) {
+    std::vector<CertificateInfo> res;
     for(auto const &crts: certs) {
-        _log("certificate: %s", toHex(crts.first).c_str());
-        if(usage_matches(crts.first, type))
-            res.push_back(crts.first);
+        _log_at(Logger::Trace, Logger::P11, "certificate: %s", toHex(crts.second.info->der).c_str());
+        if(crts.second.info->usableFor(type))
+            res.push_back(*crts.second.info);
     }
     return res;
 }
 
-CK_RV PKCS11Module::login(const std::vector<unsigned char> &cert, const char *pin) {
-    _log("Issuing C_Login");
-    auto slot = certs.find(cert)->second; // FIXME: not found
+const CertificateInfo *PKCS11Module::getCertInfo(const Fingerprint &cert) const {
+    auto entry = certs.find(cert);
+    if (entry == certs.end()) {
+        return nullptr;
+    }
+    return entry->second.info.get();
+}
 
-    // Assumes presence of session
-    if (!session) {
-        const P11Token *token = getP11Token(cert);
-        if (!token) {
-            // FIXME: error
-            return CKR_TOKEN_NOT_PRESENT;
+void PKCS11Module::closeSessions() {
+    for (const auto &session: sessions) {
+        C(CloseSession, session.second.handle);
+        for (CK_SESSION_HANDLE extra: session.second.extra)
+            C(CloseSession, extra);
+    }
+    sessions.clear();
+}
+
+// The session of the slot, opened on first use
+CK_RV PKCS11Module::session(CK_SLOT_ID slot, CK_SESSION_HANDLE &sid) {
+    P11Session &session = sessions[slot];
+    if (session.handle == CK_INVALID_HANDLE) {
+        _log_p11("Opening session for slot %lu", slot);
+        CK_RV rv = C(OpenSession, slot, CKF_SERIAL_SESSION, nullptr, nullptr, &session.handle);
+        if (rv != CKR_OK) {
+            sessions.erase(slot);
+            return rv;
         }
-        _log("Using key from slot %d with ID %s", slot.first.slot, toHex(slot.second).c_str());
-        check_C(OpenSession, token->slot, CKF_SERIAL_SESSION, nullptr, nullptr, &session);
     }
-    check_C(Login, session, CKU_USER, (unsigned char*)pin, pin ? strlen(pin) : 0);
+    sid = session.handle;
+    return CKR_OK;
+}
+
+// Drops the session and key handles of a slot if the error means they are gone
+void PKCS11Module::forget(CK_SLOT_ID slot, CK_RV reason, bool always) {
+    switch (always ? CKR_SESSION_CLOSED : reason) {
+    case CKR_SESSION_HANDLE_INVALID:
+    case CKR_SESSION_CLOSED:
+    case CKR_DEVICE_REMOVED:
+    case CKR_TOKEN_NOT_PRESENT:
+    case CKR_KEY_HANDLE_INVALID:
+    case CKR_OBJECT_HANDLE_INVALID:
+        break;
+    default:
+        return;
+    }
+    _log_p11("Forgetting session and keys of slot %lu: %s", slot, errorName(reason));
+    auto session = sessions.find(slot);
+    if (session != sessions.end()) {
+        C(CloseSession, session->second.handle);
+        for (CK_SESSION_HANDLE extra: session->second.extra)
+            C(CloseSession, extra);
+        sessions.erase(session);
+    }
+    for (auto &cert: certs) {
+        if (cert.second.token.slot == slot)
+            cert.second.key = CK_INVALID_HANDLE;
+    }
+}
+
+// Looks up the private key of the certificate once
+CK_RV PKCS11Module::key(P11Certificate &cert, CK_SESSION_HANDLE sid) {
+    if (cert.key != CK_INVALID_HANDLE)
+        return CKR_OK;
+    std::vector<CK_OBJECT_HANDLE> key = getKey(sid, cert.id);
+    if (key.size() != 1) {
+        _log_p11("No key or found multiple matches");
+        // The certificates may have changed since they were cached
+        if (!cert.cacheKey.empty())
+            CertificateCache::forget(cert.cacheKey);
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    // Absent means false. The key type is known for sure only now that the key is visible.
+    std::vector<std::vector<unsigned char>> values = attributes({CKA_ALWAYS_AUTHENTICATE, CKA_KEY_TYPE, CKA_MODULUS_BITS, CKA_EC_PARAMS}, sid, key[0]);
+    cert.alwaysAuthenticate = values[0].size() == sizeof(CK_BBOOL) && values[0][0] == CK_TRUE;
+    if (values[1].size() == sizeof(CK_KEY_TYPE))
+        cert.keyType = *(const CK_KEY_TYPE *)values[1].data();
+    // The signature length, so that signing needs no size query. The
+    // certificate knows the key size if the key does not tell.
+    int bits = cert.info->keyBits;
+    if (cert.keyType == CKK_RSA && values[2].size() == sizeof(CK_ULONG))
+        bits = int(*(const CK_ULONG *)values[2].data());
+    else if (cert.keyType == CKK_EC && curveBits(values[3]))
+        bits = curveBits(values[3]);
+    cert.signatureLength = CK_ULONG((bits + 7) / 8) * (cert.keyType == CKK_EC ? 2 : 1);
+    _log_p11("Key is %d bits, signatures are %lu bytes", bits, cert.signatureLength);
+    cert.key = key[0];
+    return CKR_OK;
+}
+
+bool PKCS11Module::needsLogin(const Fingerprint &cert, const std::string &origin, CertificatePurpose purpose) {
+    auto found = certs.find(cert);
+    if (found == certs.end() || loginTimeout <= 0)
+        return true;
+    P11Certificate &entry = found->second;
+    auto session = sessions.find(entry.token.slot);
+    if (session == sessions.end() || !session->second.login)
+        return true;
+    if (session->second.origin != origin) {
+        _log_p11("Token is logged in for another origin");
+        return true;
+    }
+    // A login for authentication must not sign with a token that has one PIN
+    if (session->second.purpose != purpose) {
+        _log_p11("Token is logged in for another purpose");
+        return true;
+    }
+    // The key may be missing on a token that is still logged in
+    CK_RV rv = key(entry, session->second.handle);
+    if (rv != CKR_OK) {
+        forget(entry.token.slot, rv);
+        return true;
+    }
+    if (entry.alwaysAuthenticate)
+        return true;
+    if (time(nullptr) - session->second.login >= loginTimeout) {
+        _log_p11("Login has timed out");
+        C(Logout, session->second.handle);
+        session->second.login = 0;
+        session->second.origin.clear();
+        return true;
+    }
+    // The token could have logged us out on its own, e.g. after a reset
+    CK_SESSION_INFO info;
+    if (C(GetSessionInfo, session->second.handle, &info) != CKR_OK ||
+            (info.state != CKS_RO_USER_FUNCTIONS && info.state != CKS_RW_USER_FUNCTIONS)) {
+        session->second.login = 0;
+        session->second.origin.clear();
+        return true;
+    }
+    return false;
+}
 
+CK_RV PKCS11Module::login(const Fingerprint &cert, const char *pin, const std::string &origin, CertificatePurpose purpose) {
+    _log_p11("Issuing C_Login");
+    auto found = certs.find(cert);
+    if (found == certs.end()) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+    const P11Certificate &slot = found->second;
+
+    _log_p11("Using key from slot %lu with ID %s", slot.token.slot, toHex(slot.id).c_str());
+    CK_SESSION_HANDLE sid;
+    CK_RV rv = session(slot.token.slot, sid);
+    if (rv == CKR_OK) {
+        // The PIN is always checked, even if an earlier login is still valid
+        if (sessions[slot.token.slot].login) {
+            C(Logout, sid);
+            sessions[slot.token.slot].login = 0;
+            sessions[slot.token.slot].origin.clear();
+        }
+        rv = C(Login, sid, CKU_USER, (unsigned char*)pin, pin ? strlen(pin) : 0);
+    }
+    if (rv != CKR_OK) {
+        forget(slot.token.slot, rv);
+        return rv;
+    }
+    sessions[slot.token.slot].login = time(nullptr);
+    sessions[slot.token.slot].origin = origin;
+    sessions[slot.token.slot].purpose = purpose;
     return CKR_OK;
 }
 
 
 
 PKCS11Module::~PKCS11Module() {
-    if (session)
-        C(CloseSession, session);
-    if (initialized)
-        C(Finalize, nullptr);
-    if (!library)
-        return;
-#ifdef _WIN32
-    FreeLibrary(library);
-#else
-    dlclose(library);
-#endif
+    unload();
 }
 
-CK_RV PKCS11Module::sign(const std::vector<unsigned char> &cert, const std::vector<unsigned char> &hash, std::vector<unsigned char> &result) {
-    auto slot = certs.find(cert)->second; // FIXME: not found
+// Modules that may be the same library underneath share a key: builds of
+// OpenSC, and the p11-kit proxy, which can wrap any other module
+static std::string backend(const std::string &path) {
+    std::string name = path.substr(path.find_last_of("/\\") + 1);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name.find("p11-kit") != std::string::npos)
+        return "*";
+    if (name.find("opensc") != std::string::npos)
+        return "opensc";
+    return name;
+}
 
-    // Assumes open session to the right token, that is already authenticated.
-    // TODO: correct handling of CKA_ALWAYS_AUTHENTICATE and associated login procedures
-    std::vector<CK_OBJECT_HANDLE> key = getKey(session, slot.second); // TODO: function signature and return code
-    if (key.size() != 1) {
-        _log("Can not sign - no key or found multiple matches");
-        return CKR_OBJECT_HANDLE_INVALID;
+std::vector<PKCS11Module *> PKCS11Registry::load(const std::vector<std::string> &paths, unsigned long generation) {
+    // Create the entries up front, the map is not touched concurrently
+    std::vector<std::string> unique;
+    for (const std::string &path: paths) {
+        if (std::find(unique.begin(), unique.end(), path) == unique.end())
+            unique.push_back(path);
+    }
+    std::vector<PKCS11Module *> loaded(unique.size());
+    for (const std::string &path: unique)
+        modules[path];
+    // Modules of the same backend are initialized one after the other
+    bool proxy = std::any_of(unique.begin(), unique.end(), [](const std::string &path) { return backend(path) == "*"; });
+    std::vector<std::string> backends;
+    std::vector<std::vector<size_t>> groups;
+    for (size_t i = 0; i < unique.size(); i++) {
+        std::string key = proxy ? "*" : backend(unique[i]);
+        size_t group = std::find(backends.begin(), backends.end(), key) - backends.begin();
+        if (group == backends.size()) {
+            backends.push_back(key);
+            groups.emplace_back();
+        }
+        groups[group].push_back(i);
     }
+    parallel(groups.size(), MAX_WORKERS, [&](size_t group) {
+        for (size_t i: groups[group])
+            loaded[i] = get(unique[i], generation);
+    });
+    active.clear();
+    for (PKCS11Module *module: loaded) {
+        if (module)
+            active.push_back(module);
+    }
+    return active;
+}
 
-    CK_MECHANISM mechanism = {CKM_RSA_PKCS, 0, 0};
-    check_C(SignInit, session, &mechanism, key[0]);
-    std::vector<unsigned char> hashWithPadding;
-    // FIXME: explicit hash type argument
-    switch (hash.size()) {
-    case BINARY_SHA224_LENGTH:
-        hashWithPadding = {0x30, 0x2d, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x04, 0x05, 0x00, 0x04, 0x1c};
-        break;
-    case BINARY_SHA256_LENGTH:
-        hashWithPadding = {0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20};
-        break;
-    case BINARY_SHA384_LENGTH:
-        hashWithPadding = {0x30, 0x41, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00, 0x04, 0x30};
-        break;
-    case BINARY_SHA512_LENGTH:
-        hashWithPadding = {0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40};
-        break;
-    default:
-        _log("incorrect digest length, dropping padding");
+// The first module in order of preference that has the certificate
+PKCS11Module *PKCS11Registry::find(const Fingerprint &cert) const {
+    for (PKCS11Module *module: active) {
+        if (module->getP11Token(cert))
+            return module;
+    }
+    return nullptr;
+}
+
+std::vector<CertificateInfo> PKCS11Registry::getCerts(CertificatePurpose type) const {
+    std::vector<CertificateInfo> result;
+    for (PKCS11Module *module: active) {
+        for (const CertificateInfo &cert: module->getCerts(type)) {
+            // Modules can see the same token
+            if (find(cert.fingerprint) == module)
+                result.push_back(cert);
+        }
     }
-    hashWithPadding.insert(hashWithPadding.end(), hash.begin(), hash.end());
-    CK_ULONG signatureLength = 0;
+    return result;
+}
 
-    // Get response size
-    check_C(Sign, session, hashWithPadding.data(), hashWithPadding.size(), nullptr, &signatureLength);
-    result.resize(signatureLength);
-    // Get actual signature
-    check_C(Sign, session, hashWithPadding.data(), hashWithPadding.size(), result.data(), &signatureLength);
+PKCS11Module *PKCS11Registry::get(const std::string &path, unsigned long generation) {
+    // Only looks up the entry if it exists, load() relies on that
+    auto found = modules.find(path);
+    Entry &entry = found != modules.end() ? found->second : modules[path];
+    if (!entry.module)
+        entry.module.reset(new PKCS11Module());
+    bool stale = entry.generation != generation;
+    entry.generation = generation;
+    CK_RV rv;
+    if (stale && entry.module->isLoaded()) {
+        _log_p11("Readers or cards have changed, enumerating %s again", path.c_str());
+        rv = entry.module->refresh();
+    } else {
+        rv = entry.module->load(path);
+    }
+    if (rv != CKR_OK) {
+        _log_error(P11, "Could not load %s: %s", path.c_str(), PKCS11Module::errorName(rv));
+        return nullptr;
+    }
+    return entry.module.get();
+}
 
-    _log("Signature: %s", toHex(result).c_str());
+CK_RV PKCS11Module::sign(const Fingerprint &cert, const std::vector<unsigned char> &hash, HashAlgorithm algorithm, std::vector<unsigned char> &result) {
+    return signMany(cert, {hash}, {algorithm}, [&](size_t, const std::vector<unsigned char> &signature) {
+        result = signature;
+    });
+}
+
+CK_RV PKCS11Module::signMany(const Fingerprint &cert, const std::vector<std::vector<unsigned char>> &hashes, const std::vector<HashAlgorithm> &algorithms,
+                             const std::function<void(size_t index, const std::vector<unsigned char> &signature)> &done) {
+    auto found = certs.find(cert);
+    if (found == certs.end()) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+    if (algorithms.size() != hashes.size()) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    P11Certificate &slot = found->second;
+
+    // Assumes that the token is logged in
+    CK_SESSION_HANDLE sid;
+    CK_RV rv = session(slot.token.slot, sid);
+    if (rv == CKR_OK)
+        rv = key(slot, sid);
+    if (rv != CKR_OK) {
+        _log_p11("Can not sign: %s", errorName(rv));
+        forget(slot.token.slot, rv);
+        return rv;
+    }
+    // The login covers one signature and the PIN is not kept around
+    if (slot.alwaysAuthenticate && hashes.size() > 1) {
+        _log_warning(P11, "Key requires a login for every signature, can not sign %zu hashes", hashes.size());
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+
+    // Nothing is signed if any of the hashes can not be
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (!signatureScheme(algorithms[i], slot.keyType, hashes[i].size())) {
+            _log_p11("Hash %zu does not match its algorithm", i);
+            return CKR_DATA_LEN_RANGE;
+        }
+    }
+
+    size_t workers = signers(slot, hashes.size());
+    if (workers > 1) {
+        rv = signParallel(slot, workers, hashes, algorithms, done);
+    } else {
+        std::vector<unsigned char> signature;
+        for (size_t i = 0; i < hashes.size() && rv == CKR_OK; i++) {
+            rv = signOne(sid, slot, hashes[i], algorithms[i], signature);
+            if (rv == CKR_OK)
+                done(i, signature);
+        }
+    }
+    if (rv != CKR_OK) {
+        // The failed operation may still be active in the session
+        forget(slot.token.slot, rv, true);
+        return rv;
+    }
 
-    // We require a new login for next signature
+    // Such keys require a new login for the next signature
     // return code is ignored
-    C(CloseSession, session);
-    session = CK_INVALID_HANDLE;
+    if (slot.alwaysAuthenticate) {
+        C(Logout, sid);
+        sessions[slot.token.slot].login = 0;
+        sessions[slot.token.slot].origin.clear();
+    }
+    return rv;
+}
+
+// How many sessions can sign at once. Keys that want a PIN for every
+// signature and PIN pads would prompt the user for each session.
+size_t PKCS11Module::signers(const P11Certificate &cert, size_t count) const {
+    if (!threadsafe || cert.alwaysAuthenticate || cert.token.has_pinpad)
+        return 1;
+    size_t workers = std::min(count, signWorkers);
+    CK_ULONG max = cert.token.max_sessions;
+    if (max != CK_EFFECTIVELY_INFINITE && max != CK_UNAVAILABLE_INFORMATION)
+        workers = std::min<size_t>(workers, max);
+    return std::max<size_t>(workers, 1);
+}
+
+// Signs on several sessions of the token at once. All sessions share the
+// login of the token. Signatures are handed over in the order of hashes.
+CK_RV PKCS11Module::signParallel(P11Certificate &cert, size_t workers, const std::vector<std::vector<unsigned char>> &hashes, const std::vector<HashAlgorithm> &algorithms,
+                                 const std::function<void(size_t index, const std::vector<unsigned char> &signature)> &done) {
+    P11Session &pooled = sessions[cert.token.slot];
+    while (pooled.extra.size() < workers - 1) {
+        CK_SESSION_HANDLE extra;
+        if (C(OpenSession, cert.token.slot, CKF_SERIAL_SESSION, nullptr, nullptr, &extra) != CKR_OK)
+            break;
+        pooled.extra.push_back(extra);
+    }
+    std::vector<CK_SESSION_HANDLE> sids{pooled.handle};
+    sids.insert(sids.end(), pooled.extra.begin(), pooled.extra.begin() + std::min(pooled.extra.size(), workers - 1));
+    _log_p11("Signing %zu hashes on %zu sessions", hashes.size(), sids.size());
+
+    std::vector<std::vector<unsigned char>> results(hashes.size());
+    std::vector<CK_RV> status(hashes.size(), CKR_OK);
+    std::vector<bool> ready(hashes.size(), false);
+    size_t delivered = 0;
+    std::mutex mutex; // protects the four above
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+
+    auto worker = [&](CK_SESSION_HANDLE sid) {
+        for (size_t i; !failed && (i = next++) < hashes.size();) {
+            std::vector<unsigned char> signature;
+            CK_RV rv = signOne(sid, cert, hashes[i], algorithms[i], signature);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (rv != CKR_OK)
+                failed = true;
+            status[i] = rv;
+            results[i].swap(signature);
+            ready[i] = true;
+            // Hand over everything that is now in order
+            for (; delivered < hashes.size() && ready[delivered] && status[delivered] == CKR_OK; delivered++) {
+                done(delivered, results[delivered]);
+                std::vector<unsigned char>().swap(results[delivered]);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    try {
+        for (size_t w = 1; w < sids.size(); w++)
+            threads.emplace_back(worker, sids[w]);
+    } catch (const std::system_error &e) {
+        // The threads that did start share the work
+        _log_warning(P11, "Signing on %zu of %zu sessions: %s", threads.size() + 1, sids.size(), e.what());
+    }
+    try {
+        worker(sids[0]);
+    } catch (...) {
+        // Whatever was started is joined before the stack goes away
+        failed = true;
+        for (std::thread &thread: threads)
+            thread.join();
+        throw;
+    }
+    for (std::thread &thread: threads)
+        thread.join();
+
+    // Hashes are taken in order, so everything before the first error is done
+    for (size_t i = delivered; i < hashes.size(); i++) {
+        if (ready[i] && status[i] != CKR_OK)
+            return status[i];
+    }
+    return CKR_OK;
+}
+
+// Signs from and into stack buffers, only result may allocate
+CK_RV PKCS11Module::signOne(CK_SESSION_HANDLE sid, const P11Certificate &cert,
+                            const std::vector<unsigned char> &hash, HashAlgorithm algorithm, std::vector<unsigned char> &result) const {
+    const SignatureScheme *scheme = signatureScheme(algorithm, cert.keyType, hash.size());
+    if (!scheme) {
+        _log_p11("Can not sign a hash of %zu bytes with algorithm %d", hash.size(), algorithm);
+        return CKR_DATA_LEN_RANGE;
+    }
+    CK_MECHANISM mechanism = {scheme->mechanism, nullptr, 0};
+    check_C(SignInit, sid, &mechanism, cert.key);
+    unsigned char data[MAX_PREFIX + MAX_HASH];
+    memcpy(data, scheme->prefix, scheme->prefixLength);
+    memcpy(data + scheme->prefixLength, hash.data(), hash.size());
+    CK_ULONG dataLength = CK_ULONG(scheme->prefixLength + hash.size());
+
+    // Room for the expected signature is offered right away. A token that
+    // wants more says so and the operation stays active.
+    unsigned char signature[MAX_SIGNATURE];
+    CK_ULONG signatureLength = cert.signatureLength && cert.signatureLength <= MAX_SIGNATURE ? cert.signatureLength : MAX_SIGNATURE;
+    CK_RV rv = C(Sign, sid, data, dataLength, signature, &signatureLength);
+    if (rv == CKR_BUFFER_TOO_SMALL && signatureLength <= MAX_SIGNATURE)
+        rv = C(Sign, sid, data, dataLength, signature, &signatureLength);
+    if (rv != CKR_OK)
+        return rv;
+    result.assign(signature, signature + signatureLength);
+
+    _log_at(Logger::Trace, Logger::P11, "Signature: %s", toHex(result).c_str());
     return CKR_OK;
 }
 
-std::pair<int, int> PKCS11Module::getPINLengths(const std::vector<unsigned char> &cert) {
+std::pair<int, int> PKCS11Module::getPINLengths(const Fingerprint &cert) {
     const P11Token *token = getP11Token(cert);
     return std::make_pair(token->pin_min, token->pin_max);
 }
 
-bool PKCS11Module::isPinpad(const std::vector<unsigned char> &cert) const {
+bool PKCS11Module::isPinpad(const Fingerprint &cert) const {
     return getP11Token(cert)->has_pinpad;
 }
 
@@ -352,12 +988,12 @@ int PKCS11Module::getPINRetryCount(const P11Token &p11token) {
     return 3;
 }
 
-const P11Token *PKCS11Module::getP11Token(const std::vector<unsigned char> &cert) const {
+const P11Token *PKCS11Module::getP11Token(const Fingerprint &cert) const {
     auto slotinfo = certs.find(cert);
     if (slotinfo == certs.end()) {
         return nullptr;
     }
-    return &(slotinfo->second.first);
+    return &(slotinfo->second.token);
 }
 const char *PKCS11Module::errorName(CK_RV err) {
     switch (err) {
@@ -20,10 +20,14 @@
 
 #include <vector>
 #include <string>
+#include <functional>
 #include <map>
+#include <memory>
+#include <unordered_map>
 
 #include "pkcs11.h"
 #include "Common.h"
+#include "certificate.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -37,32 +41,61 @@ struct P11Token {
     bool has_pinpad; // true if pinpad present
     CK_SLOT_ID slot; // Associated slot ID
     CK_FLAGS flags; // all of the flags
+    CK_ULONG max_sessions; // ulMaxSessionCount, 0 if unlimited
 };
 
 class PKCS11Module {
 public:
+    // Loads and initializes the module once, later calls only enumerate
+    // the tokens again if a slot event has been reported since
     CK_RV load(const std::string &module);
-    CK_RV login(const std::vector<unsigned char> &cert, const char *pin);
-    CK_RV sign(const std::vector<unsigned char> &cert, const std::vector<unsigned char> &hash, std::vector<unsigned char> &result);
+    CK_RV refresh();
+    bool changed();
+    void unload();
+    // Certificates are referred to by their fingerprint. The login is
+    // remembered for the origin and purpose that it was made for.
+    CK_RV login(const Fingerprint &cert, const char *pin, const std::string &origin = std::string(), CertificatePurpose purpose = UnknownPurpose);
+    CK_RV sign(const Fingerprint &cert, const std::vector<unsigned char> &hash, HashAlgorithm algorithm, std::vector<unsigned char> &result);
+    // Signs the hashes in order after a single login and hands over each
+    // signature as soon as it is made. Stops at the first error. Keys that
+    // require a login for every use can only sign one hash, more gives
+    // CKR_FUNCTION_NOT_SUPPORTED. There is an algorithm for every hash.
+    CK_RV signMany(const Fingerprint &cert, const std::vector<std::vector<unsigned char>> &hashes, const std::vector<HashAlgorithm> &algorithms,
+                   const std::function<void(size_t index, const std::vector<unsigned char> &signature)> &done);
+    // False if the token is still logged in from an earlier login for the
+    // same origin and purpose that has not timed out, and the key does not
+    // require a login for every use
+    bool needsLogin(const Fingerprint &cert, const std::string &origin = std::string(), CertificatePurpose purpose = UnknownPurpose);
 
-    bool isLoaded() {
-        return !certs.empty();
+    bool isLoaded() const {
+        return library != 0;
     }
-    std::vector<std::vector <unsigned char>> getCerts(CertificatePurpose type = CertificatePurpose(Authentication|Signing));
+    std::vector<CertificateInfo> getCerts(CertificatePurpose type = CertificatePurpose(Authentication|Signing));
+    const CertificateInfo *getCertInfo(const Fingerprint &cert) const;
 
-    const P11Token *getP11Token(const std::vector<unsigned char> &cert) const;
+    const P11Token *getP11Token(const Fingerprint &cert) const;
 
-    bool isPinpad(const std::vector<unsigned char> &cert) const;
+    bool isPinpad(const Fingerprint &cert) const;
     static int getPINRetryCount(const P11Token &cert);
-    std::pair<int, int> getPINLengths(const std::vector<unsigned char> &cert);
+    std::pair<int, int> getPINLengths(const Fingerprint &cert);
 
     ~PKCS11Module();
 
     static const char *errorName(CK_RV err);
 
+    // Objects are searched for this many at a time, WEB_EID_P11_PAGE_SIZE
+    static CK_ULONG pageSize;
+    // Sessions a batch is signed on at most, WEB_EID_SIGN_WORKERS
+    static size_t signWorkers;
+    // Seconds a login is reused for, WEB_EID_LOGIN_TIMEOUT. 0, the default,
+    // logs in every time
+    static int loginTimeout;
+
 private:
     std::string path;
     bool initialized = false;
+    bool threadsafe = false; // initialized with CKF_OS_LOCKING_OK
+    bool enumerated = false;
 #ifdef _WIN32
     HINSTANCE library = 0;
 #else
@@ -70,15 +103,76 @@ private:
 #endif
 
     CK_FUNCTION_LIST_PTR fl = nullptr;
-    CK_SESSION_HANDLE session = CK_INVALID_HANDLE; // active session
 
+    // Sessions are kept open per slot until the token goes away
+    struct P11Session {
+        CK_SESSION_HANDLE handle = CK_INVALID_HANDLE;
+        time_t login = 0; // when the user was logged in, 0 if not
+        std::string origin; // that the login was made for
+        CertificatePurpose purpose = UnknownPurpose; // same
+        std::vector<CK_SESSION_HANDLE> extra; // for signing in parallel
+    };
+    std::map<CK_SLOT_ID, P11Session> sessions;
+
+    // A certificate on a token, the key has the same CKA_ID
+    struct P11Certificate {
+        P11Token token;
+        std::vector<unsigned char> id;
+        std::shared_ptr<const CertificateInfo> info; // shared through CertificateStore
+        // The private key, found on first use
+        CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+        bool alwaysAuthenticate = false;
+        CK_KEY_TYPE keyType = CKK_RSA; // CKA_KEY_TYPE, picks the mechanism
+        CK_ULONG signatureLength = 0; // from the key size, 0 if not known
+        std::string cacheKey; // of the token in CertificateCache
+    };
     // Contains all the certificates this module exposes
-    // der maps to a pair of slot id and object id
-    std::map<std::vector<unsigned char>, std::pair<P11Token, std::vector<unsigned char>>> certs;
+    std::unordered_map<Fingerprint, P11Certificate, FingerprintHash> certs;
+
+    void enumerate(CK_SLOT_ID slot, std::vector<std::pair<Fingerprint, P11Certificate>> &found) const;
+    std::string tokenKey(const CK_TOKEN_INFO &token) const;
+    CK_RV session(CK_SLOT_ID slot, CK_SESSION_HANDLE &sid);
+    CK_RV key(P11Certificate &cert, CK_SESSION_HANDLE sid);
+    size_t signers(const P11Certificate &cert, size_t count) const;
+    CK_RV signParallel(P11Certificate &cert, size_t workers, const std::vector<std::vector<unsigned char>> &hashes, const std::vector<HashAlgorithm> &algorithms,
+                       const std::function<void(size_t index, const std::vector<unsigned char> &signature)> &done);
+    CK_RV signOne(CK_SESSION_HANDLE sid, const P11Certificate &cert,
+                  const std::vector<unsigned char> &hash, HashAlgorithm algorithm, std::vector<unsigned char> &result) const;
+    void closeSessions();
+    void forget(CK_SLOT_ID slot, CK_RV reason, bool always = false);
 
     // locates the key handle for the key with the given ID
     std::vector<CK_OBJECT_HANDLE> getKey(CK_SESSION_HANDLE session, const std::vector<unsigned char> &id) const;
+    CK_KEY_TYPE keyType(CK_SESSION_HANDLE session, const std::vector<unsigned char> &id, const CertificateInfo &info) const;
     std::vector<unsigned char> attribute(CK_ATTRIBUTE_TYPE type, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj) const;
+    std::vector<std::vector<unsigned char>> attributes(const std::vector<CK_ATTRIBUTE_TYPE> &types, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj) const;
     std::vector<CK_OBJECT_HANDLE> objects(CK_OBJECT_CLASS objectClass, CK_SESSION_HANDLE session, CK_ULONG count) const;
     std::vector<CK_OBJECT_HANDLE> objects(const std::vector<CK_ATTRIBUTE> &attr, CK_SESSION_HANDLE session, CK_ULONG count) const;
 };
+
+// Keeps every module that has been used loaded for the life of the process
+class PKCS11Registry {
+public:
+    // The generation is bumped by the caller whenever readers or cards
+    // have changed, which makes all modules enumerate their tokens again
+    PKCS11Module *get(const std::string &path, unsigned long generation);
+
+    // Loads and enumerates the modules concurrently, those that may share a
+    // backend one after the other. They make up the certificate index until
+    // the next call.
+    std::vector<PKCS11Module *> load(const std::vector<std::string> &paths, unsigned long generation);
+    PKCS11Module *find(const Fingerprint &cert) const;
+    std::vector<CertificateInfo> getCerts(CertificatePurpose type) const;
+    // The modules of the last load()
+    const std::vector<PKCS11Module *> &loaded() const {
+        return active;
+    }
+
+private:
+    struct Entry {
+        std::unique_ptr<PKCS11Module> module;
+        unsigned long generation;
+    };
+    std::map<std::string, Entry> modules;
+    std::vector<PKCS11Module *> active; // in order of preference
+};
@@ -21,12 +21,14 @@
 #include "qt_pcsc.h"
 #include "qt_pki.h"
 
-#include "util.h"
+#include "broker.h"
+#include "qt_util.h"
 #include "Logger.h" // TODO: rename
 
+#include <QElapsedTimer>
 #include <QIcon>
 #include <QJsonDocument>
-#include <QSslCertificate>
+#include <QJsonArray>
 #include <QCommandLineParser>
 #include <QTranslator>
 #include <QUrl>
@@ -36,6 +38,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <cstring>
 #include <iostream>
 
 #ifdef _WIN32
@@ -43,16 +46,21 @@
 #include <fcntl.h>
 #include <io.h>
 #else
+#include <csignal>
 #include <unistd.h>
 #endif
 
-// The lifecycle of the native components is the lifecycle of a page.
-// Every message must have an origin and the origin must not change
-// during the lifecycle of the program.
-QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, argv), tray(this) {
+// Since main(), for the startup-time breakdown
+static QElapsedTimer startup;
 
-    if (standalone) {
-        _log("Starting standalone app v%s", VERSION);
+// The lifecycle of the native components is the lifecycle of a page,
+// or of the broker that serves many pages. Every message must have an
+// origin and the origin must not change during the lifecycle of the page.
+QtHost::QtHost(int &argc, char *argv[], Mode mode) : QApplication(argc, argv), tray(this) {
+    qint64 application = startup.elapsed();
+
+    if (mode == Standalone) {
+        _log_info(Host, "Starting standalone app v%s", VERSION);
         tray.setIcon(QIcon(":/web-eid.png"));
         tray.show();
         tray.setToolTip("Web eID is running on port XXXX. Click to quit.");
@@ -62,8 +70,27 @@ QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, ar
             exit(1);
         });
         // TODO: add HTTP listener
+    } else if (mode == Broker) {
+        _log_info(Host, "Starting broker v%s", VERSION);
+        // Hosts connect here and relay the frames of their page
+        QString path = QString::fromStdString(Broker::socketPath());
+        server = new QLocalServer(this);
+        server->setSocketOptions(QLocalServer::UserAccessOption);
+        // The lock makes sure that the socket left behind is not in use
+        if (path.isEmpty() || !Broker::lock() || !QLocalServer::removeServer(path) || !server->listen(path)) {
+            _log_error(Host, "Broker not started on %s: %s", path.toStdString().c_str(), server->errorString().toStdString().c_str());
+            QTimer::singleShot(0, this, [this] { exit(EXIT_FAILURE); });
+        }
+        connect(server, &QLocalServer::newConnection, this, &QtHost::accept);
+        idle.setSingleShot(true);
+        idle.setInterval(Broker::idleTimeout() * 1000);
+        connect(&idle, &QTimer::timeout, this, [this] {
+            _log_host("Broker idle, exiting");
+            shutdown(EXIT_SUCCESS);
+        });
+        idle.start();
     } else {
-        _log("Starting browser extension host v%s args \"%s\"", VERSION, arguments().join("\" \"").toStdString().c_str());
+        _log_info(Host, "Starting browser extension host v%s args \"%s\"", VERSION, arguments().join("\" \"").toStdString().c_str());
         // Parse the window handle
         QCommandLineParser parser;
         QCommandLineOption pwindow("parent-window");
@@ -73,11 +100,22 @@ QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, ar
         if (parser.isSet(pwindow)) {
             // XXX: we can not actually utilize the window handle, as it is always 0
             // See issue #12
-            _log("Parent window handle: %d", stoi(parser.value(pwindow).toStdString()));
+            _log_host("Parent window handle: %d", stoi(parser.value(pwindow).toStdString()));
         }
 
-        // Open the output file
-        out.open(stdout, QFile::WriteOnly);
+        // Do not block the main thread if the browser is slow to read our responses
+        out.setNonBlocking(true);
+        connect(&out, &OutputWriter::drained, this, [this] {
+            if (input)
+                input->setPaused(false);
+        });
+#ifndef _WIN32
+        // A browser that went away shows up as EPIPE from write()
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        connect(&out, &OutputWriter::closed, this, [this] {
+            shutdown(EXIT_SUCCESS);
+        }, Qt::QueuedConnection);
 
         // InputChecker runs a blocking input reading loop and signals the main
         // Qt appliction when a message gas been read.
@@ -87,7 +125,9 @@ QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, ar
         input->start();
 
         // From input thread to host process
-        connect(input, &InputChecker::messageReceived, this, &QtHost::incoming, Qt::QueuedConnection);
+        connect(input, &InputChecker::messageReceived, this, [this] (const QJsonObject &json) {
+            incoming(&local, json);
+        }, Qt::QueuedConnection);
 
     }
 
@@ -101,6 +141,7 @@ QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, ar
 
     qRegisterMetaType<CertificatePurpose>();
     qRegisterMetaType<P11Token>();
+    qRegisterMetaType<std::vector<CertificateInfo>>();
 
     // From host process to PCSC and vice versa
     connect(this, &QtHost::connect_reader, &PCSC, &QtPCSC::connect_reader, Qt::QueuedConnection);
@@ -109,17 +150,17 @@ QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, ar
     connect(this, &QtHost::send_apdu, &PCSC, &QtPCSC::send_apdu, Qt::QueuedConnection);
     connect(&PCSC, &QtPCSC::apdu_sent, this, &QtHost::apdu_sent, Qt::QueuedConnection);
 
+    connect(this, &QtHost::send_apdu_batch, &PCSC, &QtPCSC::send_apdu_batch, Qt::QueuedConnection);
+    connect(&PCSC, &QtPCSC::apdu_batch_sent, this, &QtHost::apdu_batch_sent, Qt::QueuedConnection);
+
     connect(this, &QtHost::disconnect_reader, &PCSC, &QtPCSC::disconnect_reader, Qt::QueuedConnection);
+    connect(this, &QtHost::cancel_reader, &PCSC, &QtPCSC::cancel_reader, Qt::QueuedConnection);
     connect(&PCSC, &QtPCSC::reader_disconnected, this, &QtHost::reader_disconnected, Qt::QueuedConnection);
 
     // PCSC related dialogs
     connect(&PCSC, &QtPCSC::show_insert_card, this, &QtHost::show_insert_card, Qt::QueuedConnection);
     connect(&PCSC, &QtPCSC::show_select_reader, this, &QtHost::show_select_reader, Qt::QueuedConnection);
 
-    // Wire up signals for reader dialogs
-    connect(&PCSC.inuse_dialog, &QDialog::rejected, &PCSC, &QtPCSC::cancel_reader, Qt::QueuedConnection);
-    connect(&PCSC.insert_dialog, &QtInsertCard::cancel_insert, this, &QtHost::cancel_insert, Qt::QueuedConnection);
-
     // From host to PKI and vice versa
     connect(this, &QtHost::authenticate, &PKI, &QtPKI::authenticate, Qt::QueuedConnection);
     connect(&PKI, &QtPKI::authentication_done, this, &QtHost::authentication_done, Qt::QueuedConnection);
@@ -129,15 +170,22 @@ QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, ar
 
     connect(this, &QtHost::sign, &PKI, &QtPKI::sign, Qt::QueuedConnection);
     connect(&PKI, &QtPKI::sign_done, this, &QtHost::sign_done, Qt::QueuedConnection);
+    connect(this, &QtHost::sign_batch, &PKI, &QtPKI::sign_batch, Qt::QueuedConnection);
+    connect(&PKI, &QtPKI::sign_batch_progress, this, &QtHost::sign_batch_progress, Qt::QueuedConnection);
+    connect(&PKI, &QtPKI::sign_batch_done, this, &QtHost::sign_batch_done, Qt::QueuedConnection);
 
     // PKI related dialogs
     connect(&PKI, &QtPKI::show_cert_select, this, &QtHost::show_cert_select, Qt::QueuedConnection);
-    connect(&PKI.select_dialog, &QtCertSelect::cert_selected, &PKI, &QtPKI::cert_selected, Qt::QueuedConnection);
 
     // When PIN dialog needs to be shown for PKCS#11
     connect(&PKI, &QtPKI::show_pin_dialog, this, &QtHost::show_pin_dialog, Qt::QueuedConnection);
     connect(&PKI, &QtPKI::hide_pin_dialog, this, &QtHost::hide_pin_dialog, Qt::QueuedConnection);
-    connect(&PKI.pin_dialog, &QtPINDialog::login, &PKI, &QtPKI::login, Qt::QueuedConnection);
+    connect(&PKI, &QtPKI::show_confirm_dialog, this, &QtHost::show_confirm_dialog, Qt::QueuedConnection);
+    qint64 setup = startup.elapsed();
+
+    // Keep track of readers and cards from the start, so that the first
+    // request does not have to wait for PC/SC
+    PCSC::startMonitor();
 
     // Start PCSC thread
     pki_thread = new QThread;
@@ -147,18 +195,101 @@ QtHost::QtHost(int &argc, char *argv[], bool standalone) : QApplication(argc, ar
 
     PCSC.moveToThread(pcsc_thread);
     PKI.moveToThread(pki_thread);
+
+    // Cards are read and modules loaded while the browser has not sent
+    // anything yet. Requests to PKI wait for it on the PKI thread.
+    connect(this, &QtHost::prewarm, &PKI, &QtPKI::prewarm, Qt::QueuedConnection);
+    emit prewarm();
+
+    qint64 threads = startup.elapsed();
+    _log_host("Started in %lld ms: application %lld ms, signals %lld ms, threads %lld ms", threads, application, setup - application, threads - setup);
+}
+
+// Widgets take a while to build, the time goes to the startup-time breakdown.
+// True if the dialog was created.
+template <typename Dialog>
+static bool build(std::unique_ptr<Dialog> &dialog, const char *name) {
+    if (dialog)
+        return false;
+    QElapsedTimer timer;
+    timer.start();
+    dialog.reset(new Dialog);
+    _log_host("%s dialog created in %lld ms", name, timer.elapsed());
+    return true;
+}
+
+// Created in the main thread and wired up on first use
+QtCertSelect &QtHost::certDialog() {
+    if (build(cert_dialog, "Certificate selection"))
+        connect(cert_dialog.get(), &QtCertSelect::cert_selected, &PKI, &QtPKI::cert_selected, Qt::QueuedConnection);
+    return *cert_dialog;
+}
+
+QtPINDialog &QtHost::pinDialog() {
+    if (build(pin_dialog, "PIN")) {
+        connect(pin_dialog.get(), &QtPINDialog::login, &PKI, &QtPKI::login, Qt::QueuedConnection);
+        connect(pin_dialog.get(), &QtPINDialog::confirmed, &PKI, &QtPKI::confirm, Qt::QueuedConnection);
+    }
+    return *pin_dialog;
+}
+
+QtInsertCard &QtHost::insertDialog() {
+    if (build(insert_dialog, "Insert card"))
+        connect(insert_dialog.get(), &QtInsertCard::cancel_insert, this, &QtHost::cancel_insert, Qt::QueuedConnection);
+    return *insert_dialog;
+}
+
+QtReaderInUse &QtHost::inuseDialog() {
+    if (build(inuse_dialog, "Reader in use"))
+        connect(inuse_dialog.get(), &QDialog::rejected, this, &QtHost::reader_cancelled);
+    return *inuse_dialog;
+}
+
+QtSelectReader &QtHost::readerDialog() {
+    if (build(reader_dialog, "Reader selection"))
+        connect(reader_dialog.get(), &QtSelectReader::reader_selected, &PCSC, &QtPCSC::reader_selected, Qt::QueuedConnection);
+    return *reader_dialog;
+}
+
+// Dialogs are translated to the language of the page they are shown for.
+// Those created before keep the strings of their constructor.
+void QtHost::translate(const Client *client) {
+    QLocale locale = client->language.isEmpty() ? QLocale::system() : QLocale(client->language);
+    if (translator_loaded && locale == translated)
+        return;
+    _log_host("Setting language to %s", locale.name().toStdString().c_str());
+    removeTranslator(&translator);
+    translated = locale;
+    translator_loaded = true;
+    // look up translation rom resource :/translations/strings_XX.qm
+    if (translator.load(locale, QLatin1String("strings"), QLatin1String("_"), QLatin1String(":/translations"))) {
+        if (installTranslator(&translator)) {
+            _log_host("Language set");
+        } else {
+            _log_host("Language NOT set");
+        }
+    } else {
+        _log_warning(Host, "Failed to load translation");
+    }
 }
 
 void QtHost::shutdown(int exitcode) {
-    _log("Exiting with %d", exitcode);
-    // This should make the input thread close nicely.
+    _log_info(Host, "Exiting with %d", exitcode);
+    if (input) {
+        input->setPaused(false);
+        // This should make the input thread close nicely.
 #ifdef _WIN32
-    //close(_fileno(stdin));
-    input->terminate();
+        //close(_fileno(stdin));
+        input->terminate();
 #else
-    close(0);
+        close(0);
 #endif
-    _log("input closed");
+        _log_host("input closed");
+    }
+    if (server)
+        server->close();
+    out.flush();
+    PCSC::stopMonitor();
     pcsc_thread->exit(0);
     pki_thread->exit(0);
     pcsc_thread->wait();
@@ -166,30 +297,111 @@ void QtHost::shutdown(int exitcode) {
     exit(exitcode);
 }
 
-// Called whenever a message is read from browser for processing
-void QtHost::incoming(const QJsonObject &json)
-{
-    _log("Processing message");
-    QVariantMap resp;
+// A host has connected to the broker for a page
+void QtHost::accept() {
+    while (QLocalSocket *socket = server->nextPendingConnection()) {
+        if (!Broker::trusted(socket->socketDescriptor())) {
+            _log_warning(Host, "Refusing a page of another user");
+            socket->abort();
+            socket->deleteLater();
+            continue;
+        }
+        Client *client = new Client;
+        client->socket = socket;
+        clients.append(client);
+        idle.stop();
+        _log_host("Page connected, %d pages", clients.size());
+        // Unread requests stay in the socket while the page is paused
+        socket->setReadBufferSize(64 * 1024);
+        connect(socket, &QLocalSocket::readyRead, this, [this, client] { readFrames(client); });
+        connect(socket, &QLocalSocket::bytesWritten, this, [this, client] { written(client); });
+        // Queued, so that the client is not deleted while it is being served
+        connect(socket, &QLocalSocket::disconnected, this, [this, client] { disconnected(client); }, Qt::QueuedConnection);
+    }
+}
+
+// Same framing as on stdio, see InputChecker
+void QtHost::readFrames(Client *client) {
+    if (client->paused)
+        return;
+    client->input.append(client->socket->readAll());
+    while (!client->closing && !client->paused && client->input.size() >= int(sizeof(quint32))) {
+        quint32 messageLength;
+        memcpy(&messageLength, client->input.constData(), sizeof(messageLength));
+        if (messageLength > 1024*8) {
+            _log_error(Host, "Invalid message size: %u", messageLength);
+            return incoming(client, QJsonObject({}));
+        }
+        if (client->input.size() < int(sizeof(quint32) + messageLength))
+            break;
+        QJsonObject json = QJsonDocument::fromJson(client->input.mid(sizeof(quint32), int(messageLength))).object();
+        client->input.remove(0, int(sizeof(quint32) + messageLength));
+        incoming(client, json);
+    }
+}
 
-    // Serial access
-    if (!msgid.isEmpty()) {
-        _log("Already processing message %s", msgid.toStdString().c_str());
-        resp = {{"error", "process_ongoing"}, {"version", VERSION}};
-        write(resp);
+// Reading resumes once the page has taken all of its answers
+void QtHost::written(Client *client) {
+    if (!client->paused || client->socket->bytesToWrite() > 0)
         return;
+    client->paused = false;
+    readFrames(client);
+}
+
+void QtHost::disconnected(Client *client) {
+    clients.removeOne(client);
+    _log_host("Page disconnected, %d pages", clients.size());
+    // Answers to its requests go nowhere
+    for (QQueue<Request> &queue: pending) {
+        for (Request &request: queue) {
+            if (request.client == client)
+                request.client = nullptr;
+        }
     }
+    if (reader_owner == client) {
+        reader_owner = nullptr;
+        pending[PCSCChannel].enqueue({nullptr, QString()});
+        emit disconnect_reader();
+    }
+    client->socket->deleteLater();
+    delete client;
+    if (clients.isEmpty())
+        idle.start();
+}
+
+void QtHost::drop(Client *client) {
+    if (!client->socket)
+        return shutdown(EXIT_FAILURE);
+    client->closing = true;
+    client->socket->disconnectFromServer();
+}
 
+// Called whenever a message is read from browser for processing
+void QtHost::incoming(Client *client, const QJsonObject &json)
+{
+    _log_host("Processing message");
+    if (first_message) {
+        _log_host("First message %lld ms after start", startup.elapsed());
+        first_message = false;
+    }
+    QVariantMap resp;
 
     if (json.isEmpty() || !json.contains("id") || !json.contains("origin")) {
         resp = {{"error", "protocol"}, {"version", VERSION}};
-        write(resp);
-        return shutdown(EXIT_FAILURE);
+        write(client, resp);
+        return drop(client);
     }
 
-    msgid = json.value("id").toString();
+    QString id = json.value("id").toString();
+    if (client->requests.contains(id)) {
+        _log_host("Already processing message %s", id.toStdString().c_str());
+        resp = {{"error", "protocol"}, {"version", VERSION}};
+        write(client, resp);
+        return;
+    }
 
     // Origin. If unset for instance, set
+    QString &origin = client->origin;
     if (origin.isEmpty()) {
         // Check if origin is secure
         QUrl url(json.value("origin").toString());
@@ -199,183 +411,322 @@ void QtHost::incoming(const QJsonObject &json)
             // set the "human readable origin"
             // use localhost for file url-s
             if (url.scheme() == "file") {
-                friendly_origin = "localhost";
+                client->friendly_origin = "localhost";
             } else {
-                friendly_origin = url.host();
+                client->friendly_origin = url.host();
             }
         } else {
             resp = {{"error", "protocol"}};
-            write(resp);
-            return shutdown(EXIT_FAILURE);
+            write(client, resp);
+            return drop(client);
         }
         // Setting the language is also a onetime operation, thus do it here.
-        QLocale locale = json.contains("lang") ? QLocale(json.value("lang").toString()) : QLocale::system();
-        _log("Setting language to %s", locale.name().toStdString().c_str());
-        // look up translation rom resource :/translations/strings_XX.qm
-        if (translator.load(QLocale(json.value("lang").toString()), QLatin1String("strings"), QLatin1String("_"), QLatin1String(":/translations"))) {
-            if (installTranslator(&translator)) {
-                _log("Language set");
-            } else {
-                _log("Language NOT set");
-            }
-        } else {
-            _log("Failed to load translation");
-        }
+        // It is loaded when a dialog is shown.
+        client->language = json.value("lang").toString();
     } else if (origin != json.value("origin").toString()) {
         // Otherwise if already set, it must match
         resp = {{"error", "protocol"}};
-        write(resp);
-        return shutdown(EXIT_FAILURE);
+        write(client, resp);
+        return drop(client);
     }
 
-    // Command dispatch
+    // Command dispatch. Each subsystem answers its requests in order, so
+    // requests are queued unless they really conflict with an ongoing one.
     if (json.contains("version")) {
         resp = {{"version", VERSION}}; // TODO: add something here
-    } else if (json.contains("SCardConnect")) {
-        emit connect_reader(json.value("SCardConnect").toObject().value("protocol").toString());
-    } else if (json.contains("SCardDisconnect")) {
-        emit disconnect_reader();
-    } else if (json.contains("SCardTransmit")) {
-        emit send_apdu(QByteArray::fromHex(json.value("SCardTransmit").toObject().value("bytes").toString().toLatin1()));
-    } else if (json.contains("sign")) {
-        emit sign(origin, QByteArray::fromBase64(json.value("sign").toObject().value("cert").toString().toLatin1()), QByteArray::fromBase64(json.value("sign").toObject().value("hash").toString().toLatin1()), json.value("sign").toObject().value("hashalgo").toString());
-    } else if (json.contains("cert")) {
-        emit select_certificate(origin, Signing, false);
-    } else if (json.contains("auth")) {
-        emit authenticate(origin, json.value("auth").toObject().value("nonce").toString());
+    } else if (json.contains("SCardConnect") || json.contains("SCardDisconnect") || json.contains("SCardTransmit") || json.contains("SCardTransmitBatch")) {
+        // Reader selection goes through dialogs, nothing can be queued behind it.
+        // A connected reader belongs to one page until it is disconnected.
+        if (pcsc_connecting || (json.contains("SCardConnect") && !pending[PCSCChannel].isEmpty()) || (reader_owner && reader_owner != client)) {
+            _log_host("Reader connection ongoing, rejecting %s", id.toStdString().c_str());
+            resp = {{"error", "process_ongoing"}, {"version", VERSION}};
+        } else {
+            start(PCSCChannel, client, id);
+            if (json.contains("SCardConnect")) {
+                pcsc_connecting = true;
+                emit connect_reader(json.value("SCardConnect").toObject().value("protocol").toString());
+            } else if (json.contains("SCardDisconnect")) {
+                emit disconnect_reader();
+            } else if (json.contains("SCardTransmit")) {
+                emit send_apdu(QByteArray::fromHex(json.value("SCardTransmit").toObject().value("bytes").toString().toLatin1()));
+            } else {
+                // {"apdus": [{"bytes": "...", "sw": "9000"}, ...], "stopOnMismatch": true}
+                // The reply has "mismatch", the index of the APDU that stopped it
+                QJsonObject batch = json.value("SCardTransmitBatch").toObject();
+                QByteArrayList apdus, expected;
+                for (const QJsonValue &apdu: batch.value("apdus").toArray()) {
+                    apdus << QByteArray::fromHex(apdu.toObject().value("bytes").toString().toLatin1());
+                    expected << QByteArray::fromHex(apdu.toObject().value("sw").toString().toLatin1());
+                }
+                emit send_apdu_batch(apdus, expected, batch.value("stopOnMismatch").toBool(true));
+            }
+        }
+    } else if (json.contains("sign") || json.contains("signBatch") || json.contains("cert") || json.contains("auth")) {
+        // Certificate selection and PIN entry handle one operation at a time
+        if (!pending[PKIChannel].isEmpty()) {
+            _log_host("Already processing message %s", pending[PKIChannel].head().id.toStdString().c_str());
+            resp = {{"error", "process_ongoing"}, {"version", VERSION}};
+        } else {
+            start(PKIChannel, client, id);
+            // Operations with certificates end up in dialogs, or in the ones of Windows
+            translate(client);
+            if (json.contains("sign")) {
+                emit sign(origin, QByteArray::fromBase64(json.value("sign").toObject().value("cert").toString().toLatin1()), QByteArray::fromBase64(json.value("sign").toObject().value("hash").toString().toLatin1()), json.value("sign").toObject().value("hashalgo").toString());
+            } else if (json.contains("signBatch")) {
+                // {"cert": "...", "hashes": [{"hash": "...", "hashalgo": "SHA-256"}, ...]}
+                QJsonObject batch = json.value("signBatch").toObject();
+                QByteArrayList hashes;
+                QStringList hashalgos;
+                for (const QJsonValue &hash: batch.value("hashes").toArray()) {
+                    hashes << QByteArray::fromBase64(hash.toObject().value("hash").toString().toLatin1());
+                    hashalgos << hash.toObject().value("hashalgo").toString();
+                }
+                emit sign_batch(origin, QByteArray::fromBase64(batch.value("cert").toString().toLatin1()), hashes, hashalgos);
+            } else if (json.contains("cert")) {
+                emit select_certificate(origin, Signing, false);
+            } else {
+                emit authenticate(origin, json.value("auth").toObject().value("nonce").toString());
+            }
+        }
     } else {
         resp = {{"error", "protocol"}};
     }
     if (!resp.empty()) {
-        write(resp);
+        resp["id"] = id;
+        write(client, resp);
     }
 }
 
+void QtHost::start(Channel channel, Client *client, const QString &id) {
+    client->requests.insert(id);
+    pending[channel].enqueue({client, id});
+}
+
+QtHost::Client *QtHost::current(Channel channel) {
+    if (!pending[channel].isEmpty() && pending[channel].head().client)
+        return pending[channel].head().client;
+    return &local;
+}
 
 // Callback from PKI
 void QtHost::authentication_done(const CK_RV status, const QString &token) {
-    _log("authentication done");
+    _log_host("authentication done");
     if (status == CKR_OK) {
-        outgoing({{"token", token}});
+        reply(PKIChannel, {{"token", token}});
     } else {
-        outgoing({{"error", QtPKI::errorName(status)}});
+        reply(PKIChannel, {{"error", QtPKI::errorName(status)}});
     }
 }
 
 void QtHost::sign_done(const CK_RV status, const QByteArray &signature) {
-    _log("sign done");
+    _log_host("sign done");
     if (status == CKR_OK) {
-        outgoing({{"signature", signature.toBase64()}});
+        reply(PKIChannel, {{"signature", signature.toBase64()}});
     } else {
-        outgoing({{"error", QtPKI::errorName(status)}});
+        reply(PKIChannel, {{"error", QtPKI::errorName(status)}});
+    }
+}
+
+// Every signature of a batch goes out as soon as it is made
+void QtHost::sign_batch_progress(int index, const QByteArray &signature) {
+    progress(PKIChannel, {{"index", index}, {"signature", signature.toBase64()}});
+}
+
+void QtHost::sign_batch_done(const CK_RV status, int count) {
+    _log_host("sign batch done, %d signatures", count);
+    if (status == CKR_OK) {
+        reply(PKIChannel, {{"signed", count}});
+    } else {
+        reply(PKIChannel, {{"error", QtPKI::errorName(status)}, {"signed", count}});
     }
 }
 
 void QtHost::select_certificate_done(const CK_RV status, const QByteArray &certificate) {
-    _log("select done: %s", certificate.toBase64().toStdString().c_str());
+    _log_at(Logger::Trace, Logger::Host, "select done: %s", certificate.toBase64().toStdString().c_str());
     if (status != CKR_OK) {
-        outgoing({{"error", QtPKI::errorName(status)}});
+        reply(PKIChannel, {{"error", QtPKI::errorName(status)}});
     } else {
-        outgoing({{"cert", certificate.toBase64()}});
+        reply(PKIChannel, {{"cert", certificate.toBase64()}});
     }
 }
 
 // Show certificate selection dialog and emit the chosen dialog
 // TODO: emit straight from dialog, removing signal from this object
-void QtHost::show_cert_select(const QString origin, std::vector<std::vector<unsigned char>> certs, CertificatePurpose purpose) {
-    _log("Showign cert select dialog");
+void QtHost::show_cert_select(const QString origin, std::vector<CertificateInfo> certs, CertificatePurpose purpose) {
+    _log_host("Showign cert select dialog");
     // Trigger dialog
-    PKI.select_dialog.getCert(certs, friendly_origin, purpose); // FIXME: signature (use Q)
+    translate(current(PKIChannel));
+    certDialog().getCert(certs, current(PKIChannel)->friendly_origin, purpose); // FIXME: signature (use Q)
 }
 
 void QtHost::show_pin_dialog(const CK_RV last, P11Token token, QByteArray cert, CertificatePurpose purpose) {
-    _log("Show pin dialog");
-    PKI.pin_dialog.showit(last, token, ba2v(cert), origin, purpose);
+    _log_host("Show pin dialog");
+    translate(current(PKIChannel));
+    pinDialog().showit(last, token, ba2v(cert), current(PKIChannel)->origin, purpose);
+}
+
+// The token is still logged in, the user only confirms the signature
+void QtHost::show_confirm_dialog(P11Token token, QByteArray cert) {
+    _log_host("Show confirm dialog");
+    translate(current(PKIChannel));
+    pinDialog().confirm(token, ba2v(cert), current(PKIChannel)->origin);
 }
 
 // Called after pinpad login has returned
 void QtHost::hide_pin_dialog() {
-    PKI.pin_dialog.hide();
+    if (pin_dialog)
+        pin_dialog->hide();
 }
 
 // Callbacks from PCSC
 void QtHost::reader_connected(LONG status, const QString &reader, const QString &protocol, const QByteArray &atr) {
-    if (status == SCARD_S_SUCCESS) {
-        _log("HOST: reader connected");
-        PCSC.inuse_dialog.showit(friendly_origin, reader);
-        outgoing({{"reader", reader},
+    pcsc_connecting = false;
+    if (status == SCARD_S_SUCCESS && !pending[PCSCChannel].isEmpty() && !pending[PCSCChannel].head().client) {
+        _log_host("HOST: reader connected for a page that is gone");
+        reply(PCSCChannel, {});
+        pending[PCSCChannel].enqueue({nullptr, QString()});
+        emit disconnect_reader();
+    } else if (status == SCARD_S_SUCCESS) {
+        _log_host("HOST: reader connected");
+        reader_owner = current(PCSCChannel);
+        translate(reader_owner);
+        inuseDialog().showit(reader_owner->friendly_origin, reader);
+        reply(PCSCChannel, {{"reader", reader},
             {"atr", atr.toHex()},
             {"protocol", protocol}
         });
     } else {
-        _log("HOST: reader NOT connected: %s", PCSC::errorName(status));
-        outgoing({{"error", PCSC::errorName(status)}});
+        _log_warning(Host, "HOST: reader NOT connected: %s", PCSC::errorName(status));
+        reply(PCSCChannel, {{"error", PCSC::errorName(status)}});
     }
 }
 
 void QtHost::apdu_sent(LONG status, const QByteArray &response) {
-    _log("HOST: APDU sent");
+    _log_host("HOST: APDU sent");
     if (status == SCARD_S_SUCCESS) {
-        outgoing({{"bytes", response.toHex()}});
+        reply(PCSCChannel, {{"bytes", response.toHex()}});
     } else {
-        outgoing({{"error", PCSC::errorName(status)}});
+        reply(PCSCChannel, {{"error", PCSC::errorName(status)}});
     }
 }
 
+void QtHost::apdu_batch_sent(LONG status, const QByteArrayList &responses, int mismatch) {
+    _log_host("HOST: APDU batch sent");
+    QVariantList hex;
+    for (const QByteArray &response: responses)
+        hex << QString::fromLatin1(response.toHex());
+    // Responses received before an error are returned as well
+    QVariantMap result = {{"responses", hex}};
+    if (status != SCARD_S_SUCCESS)
+        result["error"] = PCSC::errorName(status);
+    // The response of the APDU that stopped the batch is the last one
+    if (mismatch >= 0)
+        result["mismatch"] = mismatch;
+    reply(PCSCChannel, result);
+}
+
 void QtHost::show_insert_card(bool show, const QString &name, const SCARDCONTEXT ctx) {
     if (show) {
-        PCSC.insert_dialog.showit(friendly_origin, name, ctx);
-    } else {
-        PCSC.insert_dialog.hide();
+        translate(current(PCSCChannel));
+        insertDialog().showit(current(PCSCChannel)->friendly_origin, name, ctx);
+    } else if (insert_dialog) {
+        insert_dialog->hide();
     }
 }
 
 void QtHost::show_select_reader(const QString &protocol) {
-    PCSC.select_dialog.showit(friendly_origin, protocol, PCSC::readerList());
+    translate(current(PCSCChannel));
+    readerDialog().showit(current(PCSCChannel)->friendly_origin, protocol, PCSC::readerList());
 }
 
 
 // Called from the "insert card" dialog in the main thread to cancel
 // SCardGetStatusChange in the PC/SC thread
 void QtHost::cancel_insert(const SCARDCONTEXT ctx) {
-    _log("HOST: Canceling ongoing PC/SC calls");
+    _log_host("HOST: Canceling ongoing PC/SC calls");
     PCSC::cancel(ctx);
 }
 
+// The user took the reader away from the page. The page is told in order
+// with its other PC/SC requests, without an ID as it did not ask.
+void QtHost::reader_cancelled() {
+    if (!reader_owner)
+        return;
+    _log_host("HOST: reader access cancelled");
+    pending[PCSCChannel].enqueue({reader_owner, QString()});
+    emit cancel_reader();
+}
+
 // Called from the PC/SC thread to close the "Reader in use" dialog
-void QtHost::reader_disconnected() {
-    _log("HOST: reader disconnected");
-    PCSC.inuse_dialog.hide();
-    outgoing({}); // FIXME: why this here?
+void QtHost::reader_disconnected(LONG status) {
+    _log_host("HOST: reader disconnected: %s", PCSC::errorName(status));
+    reader_owner = nullptr;
+    if (inuse_dialog)
+        inuse_dialog->hide();
+    // Answers SCardDisconnect, or the request queued by reader_cancelled(),
+    // or the one queued for a page that went away
+    if (status == SCARD_S_SUCCESS)
+        reply(PCSCChannel, {});
+    else
+        reply(PCSCChannel, {{"error", PCSC::errorName(status)}});
 }
 
-void QtHost::outgoing(const QVariantMap &resp) {
+// Answers the oldest request to the subsystem
+void QtHost::reply(Channel channel, const QVariantMap &resp) {
     QVariantMap map = resp;
-    write(map);
+    // Without a pending request it is a "technical send"
+    if (pending[channel].isEmpty())
+        return write(&local, map);
+    Request request = pending[channel].dequeue();
+    if (!request.client)
+        return;
+    request.client->requests.remove(request.id);
+    if (!request.id.isEmpty())
+        map["id"] = request.id;
+    write(request.client, map);
 }
 
-void QtHost::write(QVariantMap &resp)
-{
-    // Without a valid message ID it is a "technical send"
-    if (!msgid.isEmpty()) {
-        resp["id"] = msgid;
-        msgid.clear();
+// Part of the answer to the oldest request of the channel, more will follow
+void QtHost::progress(Channel channel, const QVariantMap &resp) {
+    QVariantMap map = resp;
+    if (!pending[channel].isEmpty()) {
+        if (!pending[channel].head().client)
+            return;
+        map["id"] = pending[channel].head().id;
     }
+    write(current(channel), map);
+}
 
-    QByteArray response =  QJsonDocument::fromVariant(resp).toJson();
-    quint32 responseLength = response.size();
-    _log("Response(%u) %s", responseLength, response.constData());
-    out.write((const char*)&responseLength, sizeof(responseLength));
-    out.write(response);
-    out.flush();
+void QtHost::write(Client *client, const QVariantMap &resp)
+{
+    if (client->socket) {
+        // The socket buffers whatever the host has not read yet
+        OutputWriter::encode(frame, resp);
+        client->socket->write(frame);
+        if (!client->paused && client->socket->bytesToWrite() > OutputWriter::HIGH_WATER) {
+            _log_host("Page is slow to read, pausing its requests");
+            client->paused = true;
+        }
+        return;
+    }
+    if (!out.write(resp)) {
+        _log_host("Browser is slow to read, %d bytes pending", out.pending());
+        if (out.congested() && input) {
+            _log_host("Pausing requests until the browser catches up");
+            input->setPaused(true);
+        }
+    }
 }
 
 int main(int argc, char *argv[])
 {
-    bool standalone = false;
+    startup.start();
+    QtHost::Mode mode = QtHost::Browser;
 
-    // Check if run as a browser extension
-    if (argc > 1) {
+    if (argc > 1 && strcmp(argv[1], "--broker") == 0) {
+        mode = QtHost::Broker;
+    } else if (argc > 1) {
+        // Check if run as a browser extension
         std::string arg1(argv[1]);
         if (arg1.find("chrome-extension://") == 0) {
             // Chrome extension
@@ -402,8 +753,14 @@ int main(int argc, char *argv[])
         _setmode(_fileno(stdin), O_BINARY);
         _setmode(_fileno(stdout), O_BINARY);
 #endif
+        // The page is served by the broker if there is one
+        if (Broker::enabled()) {
+            int exitcode = Broker::forward(argv[0]);
+            if (exitcode >= 0)
+                return exitcode;
+        }
     } else if (argc == 1) {
-        standalone = true;
+        mode = QtHost::Standalone;
     }
-    return QtHost(argc, argv, standalone).exec();
+    return QtHost(argc, argv, mode).exec();
 }
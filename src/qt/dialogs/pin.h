@@ -19,7 +19,7 @@
 #pragma once
 
 #include "pkcs11module.h"
-#include "util.h" // helpers
+#include "der.h"
 #include "Logger.h"
 
 #include <QDialog>
@@ -105,15 +105,39 @@ public:
             // Exec
             int dlg = exec();
             if (dlg == QDialog::Rejected) {
-                _log("Rejected");
+                _log_ui("Rejected");
                 emit login(CKR_FUNCTION_CANCELED, 0, type);
             } else if (dlg == QDialog::Accepted) {
-                _log("PIN is %s", pin->text().toUtf8().toStdString().c_str());
+                _log_ui("PIN accepted");
                 emit login(CKR_OK, pin->text(), type);
+                pin->clear();
             }
         }
     }
 
+    // Asks to sign with the login that is still valid, without a PIN
+    void confirm(const P11Token &p11token, const std::vector<unsigned char> &cert, const QString &origin)
+    {
+        setWindowTitle(tr("Signing at %1").arg(origin));
+        nameLabel->setText(x509subject(cert).c_str());
+        pinLabel->setText(tr("Sign with \"%1\" using the PIN entered earlier?").arg(QString::fromStdString(p11token.label)));
+        errorLabel->hide();
+        progress->hide();
+        showpwd->hide();
+        pin->hide();
+        buttons->show();
+        ok->setText(tr("Sign"));
+        ok->setEnabled(true);
+        ok->setFocus();
+        if (exec() == QDialog::Accepted) {
+            _log_ui("Signing confirmed");
+            emit confirmed(CKR_OK);
+        } else {
+            _log_ui("Rejected");
+            emit confirmed(CKR_FUNCTION_CANCELED);
+        }
+    }
+
     QtPINDialog() : layout(new QVBoxLayout(this)),
         nameLabel(new QLabel(this)),
         pinLabel(new QLabel(this)),
@@ -170,6 +194,7 @@ public:
 
 signals:
     void login(CK_RV status, const QString &pin, CertificatePurpose purpose);
+    void confirmed(CK_RV status);
 
 private:
     QVBoxLayout *layout;
@@ -19,7 +19,8 @@
 #pragma once
 
 #include "Common.h"
-#include "util.h"
+#include "certificate.h"
+#include "qt/qt_util.h"
 #include "pkcs11.h"
 #include <QDialog>
 #include <QDialogButtonBox>
@@ -35,20 +36,18 @@ class QtCertSelect: public QDialog {
 
 public:
 
-    void getCert(const std::vector<std::vector<unsigned char>> &certs, const QString &origin, CertificatePurpose type) {
-        std::vector<unsigned char> result;
+    void getCert(const std::vector<CertificateInfo> &certs, const QString &origin, CertificatePurpose type) {
         table->clear();
         // Construct the list that is shown to the user.
-        for (const std::vector<unsigned char> &c: certs) {
-            QSslCertificate cert = v2cert(c);
+        for (const CertificateInfo &c: certs) {
             // filter out expired certificates
             // TODO: not here
-            if (QDateTime::currentDateTime() >= cert.expiryDate())
+            if (c.expired())
                 continue;
             table->insertTopLevelItem(0, new QTreeWidgetItem(table, QStringList{
-                cert.subjectInfo(QSslCertificate::CommonName).at(0),
-                cert.subjectInfo(QSslCertificate::Organization).at(0),
-                cert.expiryDate().toString("dd.MM.yyyy"),
+                QString::fromStdString(c.subjectCN),
+                QString::fromStdString(c.subjectO),
+                QDateTime::fromTime_t(uint(c.expiry)).toString("dd.MM.yyyy"),
                 QString::number(&c - &certs[0])})); // Index of certs list
         }
 
@@ -63,7 +62,7 @@ public:
         if (exec() == 0) {
             return emit cert_selected(CKR_FUNCTION_CANCELED, 0, type);
         }
-        emit cert_selected(CKR_OK, v2ba(certs[table->currentItem()->text(3).toUInt()]), type);
+        emit cert_selected(CKR_OK, v2ba(certs[table->currentItem()->text(3).toUInt()].der), type);
     }
 
 
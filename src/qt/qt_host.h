@@ -20,15 +20,29 @@
 
 #include "pkcs11module.h"
 #include "qt_input.h"
+#include "qt_output.h"
 #include "qt_pcsc.h"
 #include "qt_pki.h"
 
+#include "dialogs/insert_card.h"
+#include "dialogs/pin.h"
+#include "dialogs/reader_in_use.h"
+#include "dialogs/select_cert.h"
+#include "dialogs/select_reader.h"
+
 #include <QApplication>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QSystemTrayIcon>
+#include <QTimer>
 #include <QTranslator>
-#include <QFile>
 #include <QVariantMap>
 #include <QJsonObject>
+#include <QLocale>
+#include <QQueue>
+#include <QSet>
+
+#include <memory>
 
 #ifdef _WIN32
 #include <qt_windows.h>
@@ -36,23 +50,40 @@
 
 Q_DECLARE_METATYPE(CertificatePurpose)
 Q_DECLARE_METATYPE(P11Token)
+Q_DECLARE_METATYPE(CertificateInfo)
 
 class QtHost: public QApplication
 {
     Q_OBJECT
 
 public:
-    QtHost(int &argc, char *argv[], bool standalone);
+    enum Mode {
+        Browser, // started by the browser for a page
+        Standalone,
+        Broker // serves the pages of hosts that forward to it
+    };
+    QtHost(int &argc, char *argv[], Mode mode);
 
     // TODO: It is currently assumed that all invocations from one origin
     // go to the same PKCS#11 module
     PKCS11Module pkcs11;
 
-    // Thus the origin can not change, once set
-    QString origin;
-
-    // Friently origin is something that can be shown to the user
-    QString friendly_origin;
+    // A page. There is one for stdio, and in broker mode one for every
+    // connected host
+    struct Client {
+        // The origin can not change, once set
+        QString origin;
+        // Friently origin is something that can be shown to the user
+        QString friendly_origin;
+        // Of the dialogs, the system language if empty
+        QString language;
+        // Requests that are being processed, by message ID
+        QSet<QString> requests;
+        QLocalSocket *socket = nullptr; // nullptr for stdio
+        QByteArray input; // not yet complete frames from the socket
+        bool closing = false;
+        bool paused = false; // not read while its answers back up
+    };
 
     // And the chosen signing certificate can not change either
     // Only with a new cert message
@@ -65,6 +96,14 @@ public:
     QtPCSC PCSC;
     QtPKI PKI;
 
+    // Dialogs of both, in the main thread. They are created when first
+    // shown, APDU-only pages never pay for the widgets.
+    QtCertSelect &certDialog();
+    QtPINDialog &pinDialog();
+    QtInsertCard &insertDialog();
+    QtReaderInUse &inuseDialog();
+    QtSelectReader &readerDialog();
+
     // both in a separate thread
     QThread *pcsc_thread;
     QThread *pki_thread;
@@ -72,48 +111,97 @@ public:
 public slots:
     // Called when a message has been received from the
     // browser, using the Qt signaling mechanism
-    void incoming(const QJsonObject &json);
-
-    // Called when a message is to be sent back to the browser
-    void outgoing(const QVariantMap &resp);
+    void incoming(Client *client, const QJsonObject &json);
 
     // PKI
     void sign_done(const CK_RV status, const QByteArray &signature);
+    void sign_batch_progress(int index, const QByteArray &signature);
+    void sign_batch_done(const CK_RV status, int count);
     void authentication_done(const CK_RV status, const QString &token);
     void select_certificate_done(const CK_RV status, const QByteArray &certificate);
 
-    void show_cert_select(const QString origin, std::vector<std::vector<unsigned char>> certs, CertificatePurpose purpose);
+    void show_cert_select(const QString origin, std::vector<CertificateInfo> certs, CertificatePurpose purpose);
     void show_pin_dialog(const CK_RV last, P11Token token, QByteArray cert, CertificatePurpose purpose);
     void hide_pin_dialog();
+    void show_confirm_dialog(P11Token token, QByteArray cert);
 
     // PCSC
     void reader_connected(LONG status, const QString &reader, const QString &protocol, const QByteArray &atr);
     void apdu_sent(LONG status, const QByteArray &response);
-    void reader_disconnected();
+    void apdu_batch_sent(LONG status, const QByteArrayList &responses, int mismatch);
+    void reader_disconnected(LONG status);
+    void reader_cancelled(); // from the "reader in use" dialog
 
     void show_insert_card(bool show, const QString &name, const SCARDCONTEXT ctx);
     void show_select_reader(const QString &protocol);
     void cancel_insert(const SCARDCONTEXT ctx); // TODO: move to PCSC and call directly from dialog
 
 signals:
+    void prewarm();
     void authenticate(const QString &origin, const QString &nonce);
     void sign(const QString &origin, const QByteArray &cert, const QByteArray &hash, const QString &hashalgo);
+    void sign_batch(const QString &origin, const QByteArray &cert, const QByteArrayList &hashes, const QStringList &hashalgos);
     void select_certificate(const QString &origin, CertificatePurpose purpose, bool silent);
 
     void login(const QString &pin, CertificatePurpose purpose);
 
     void connect_reader(const QString &protocol);
     void send_apdu(const QByteArray &apdu);
+    void send_apdu_batch(const QByteArrayList &apdus, const QByteArrayList &expected, bool stop);
     void disconnect_reader();
+    void cancel_reader();
 
 private:
-    QString msgid; // If a message is being processed, set to ID
+    // Every subsystem answers its requests in the order they were made.
+    enum Channel {
+        PCSCChannel,
+        PKIChannel
+    };
+    struct Request {
+        Client *client; // nullptr once the client is gone
+        QString id;
+    };
+    QQueue<Request> pending[2];
+    bool pcsc_connecting = false; // reader selection dialog is shown
+    Client *reader_owner = nullptr; // the page that has connected to a reader
+
+    void start(Channel channel, Client *client, const QString &id);
+    void reply(Channel channel, const QVariantMap &resp);
+    void progress(Channel channel, const QVariantMap &resp);
+    // The page of the oldest request to the subsystem, stdio if none
+    Client *current(Channel channel);
+
     QSystemTrayIcon tray;
 
-    QFile out;
-    void write(QVariantMap &resp);
+    Client local;
+    OutputWriter out;
+    QByteArray frame; // reused for the answers to the pages of the broker
+    void write(Client *client, const QVariantMap &resp);
+    // Ends the page after a protocol error
+    void drop(Client *client);
     void shutdown(int exitcode);
-    InputChecker *input;
-
+    InputChecker *input = nullptr;
+
+    // Broker mode
+    QLocalServer *server = nullptr;
+    QList<Client *> clients;
+    QTimer idle; // exits when no page has connected for a while
+    void accept();
+    void readFrames(Client *client);
+    void written(Client *client);
+    void disconnected(Client *client);
+
+    // Translations are only loaded before a dialog is shown
     QTranslator translator;
+    QLocale translated = QLocale::c(); // the locale of translator
+    bool translator_loaded = false;
+    void translate(const Client *client);
+
+    std::unique_ptr<QtCertSelect> cert_dialog;
+    std::unique_ptr<QtPINDialog> pin_dialog;
+    std::unique_ptr<QtInsertCard> insert_dialog;
+    std::unique_ptr<QtReaderInUse> inuse_dialog;
+    std::unique_ptr<QtSelectReader> reader_dialog;
+
+    bool first_message = true; // for the startup-time breakdown
 };
@@ -21,12 +21,24 @@
 #include "Logger.h"
 
 #include <QCoreApplication>
+#include <QMutex>
 #include <QThread>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QWaitCondition>
 
-#include <iostream>
+#include <vector>
+#include <cerrno>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Reads length-prefixed native messaging frames straight from fd 0.
+// The frame buffer is reused between messages and only ever grows.
+// While paused no frames are read, which holds the browser back.
 class InputChecker: public QThread {
     Q_OBJECT
 
@@ -36,27 +48,67 @@ public:
     void run() {
         setTerminationEnabled(true);
         quint32 messageLength = 0;
-        _log("Waiting for messages");
-        // Here we do busy-sleep
-        while (std::cin.read((char*)&messageLength, sizeof(messageLength))) {
-            _log("Message size: %u", messageLength);
+        _log_host("Waiting for messages");
+        while (waitResumed() && readFully(&messageLength, sizeof(messageLength))) {
+            _log_host("Message size: %u", messageLength);
             if (messageLength > 1024*8) {
-                _log("Invalid message size: %u", messageLength);
+                _log_error(Host, "Invalid message size: %u", messageLength);
                 // This will result in a properly terminated connection
                 return emit messageReceived(QJsonObject({}));
-            } else {
-                QByteArray msg(int(messageLength), 0);
-                std::cin.read(msg.data(), msg.size());
-                _log("Message (%u): %s", messageLength, msg.constData());
-                QJsonObject json = QJsonDocument::fromJson(msg).object();
-                emit messageReceived(json);
             }
+            if (buffer.size() < messageLength)
+                buffer.resize(messageLength);
+            if (!readFully(buffer.data(), messageLength))
+                break;
+            _log_at(Logger::Trace, Logger::Host, "Message (%u): %.*s", messageLength, int(messageLength), buffer.data());
+            // Parsed in place, the emitted object is implicitly shared
+            QJsonObject json = QJsonDocument::fromJson(QByteArray::fromRawData(buffer.data(), int(messageLength))).object();
+            emit messageReceived(json);
         }
-        _log("Input reading thread is done.");
+        _log_host("Input reading thread is done.");
         // If input is closed, we quit
         QCoreApplication::exit(0);
     }
 
+    void setPaused(bool pause) {
+        QMutexLocker lock(&mutex);
+        paused = pause;
+        if (!paused)
+            resumed.wakeAll();
+    }
+
 signals:
     void messageReceived(const QJsonObject &msg);
+
+private:
+    bool waitResumed() {
+        QMutexLocker lock(&mutex);
+        while (paused)
+            resumed.wait(&mutex);
+        return true;
+    }
+
+    // Blocks until size bytes have been read. Returns false on EOF or error
+    bool readFully(void *data, size_t size) {
+        char *p = static_cast<char *>(data);
+        while (size > 0) {
+#ifdef _WIN32
+            int n = _read(0, p, unsigned(size));
+#else
+            ssize_t n = read(0, p, size);
+#endif
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    std::vector<char> buffer;
+    QMutex mutex;
+    QWaitCondition resumed;
+    bool paused = false;
 };
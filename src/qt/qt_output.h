@@ -0,0 +1,261 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "Logger.h"
+
+#include <QObject>
+#include <QByteArray>
+#include <QSocketNotifier>
+#include <QVariantMap>
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#endif
+
+// Writes length-prefixed native messaging frames to fd 1, one write() per frame.
+// In non-blocking mode a frame that does not fit into the pipe is kept in
+// a backlog and written out when the browser has drained the pipe. Once a
+// write fails the browser is gone, closed() is emitted and nothing more is
+// written.
+class OutputWriter: public QObject {
+    Q_OBJECT
+
+public:
+    // Above this many unwritten bytes the writer is congested, and the
+    // host reads no more requests until the backlog has drained
+    static const int HIGH_WATER = 1024 * 1024;
+
+    OutputWriter(QObject *parent = nullptr): QObject(parent) {
+        frame.reserve(4096);
+    }
+
+    ~OutputWriter() {
+        flush();
+    }
+
+    // Replaces the content of frame with the length-prefixed compact JSON
+    // of msg, reusing its capacity
+    static void encode(QByteArray &frame, const QVariantMap &msg) {
+        // The length prefix is reserved in front and filled in afterwards
+        frame.resize(sizeof(quint32));
+        appendJson(frame, msg);
+        quint32 length = quint32(frame.size() - sizeof(quint32));
+        memcpy(frame.data(), &length, sizeof(length));
+    }
+
+    // Returns false if the frame could not be written out right away
+    bool write(const QVariantMap &msg) {
+        if (broken)
+            return true;
+        encode(frame, msg);
+        _log_at(Logger::Trace, Logger::Host, "Response(%u) %.*s", quint32(frame.size() - sizeof(quint32)), int(frame.size() - sizeof(quint32)), frame.constData() + sizeof(quint32));
+
+        // Keep the order of frames
+        if (!backlog.isEmpty()) {
+            backlog.append(frame);
+            return false;
+        }
+        int written = writeSome(frame.constData(), frame.size(), !nonblocking);
+        if (written == frame.size() || broken)
+            return true;
+        backlog.append(frame.constData() + written, frame.size() - written);
+        notifier->setEnabled(true);
+        return false;
+    }
+
+    // Does nothing on Windows, where stdout is always blocking
+    void setNonBlocking(bool enable) {
+#ifndef _WIN32
+        int flags = fcntl(1, F_GETFL);
+        if (flags == -1 || fcntl(1, F_SETFL, enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1) {
+            _log_warning(Host, "Could not change stdout mode: %s", strerror(errno));
+            return;
+        }
+        if (enable && !notifier) {
+            notifier = new QSocketNotifier(1, QSocketNotifier::Write, this);
+            notifier->setEnabled(false);
+            connect(notifier, &QSocketNotifier::activated, this, &OutputWriter::drain);
+        }
+        nonblocking = enable;
+#else
+        Q_UNUSED(enable);
+#endif
+    }
+
+    // Bytes waiting for the browser to read them
+    int pending() const {
+        return backlog.size();
+    }
+
+    bool congested() const {
+        return pending() > HIGH_WATER;
+    }
+
+    // Blocks until the backlog has been written out
+    void flush() {
+        if (backlog.isEmpty())
+            return;
+        if (!broken)
+            writeSome(backlog.constData(), backlog.size(), true);
+        backlog.clear();
+        if (notifier)
+            notifier->setEnabled(false);
+    }
+
+signals:
+    // The backlog has been written out
+    void drained();
+    // Writing failed, the browser has gone away
+    void closed();
+
+private slots:
+    void drain() {
+        int written = writeSome(backlog.constData(), backlog.size(), false);
+        backlog.remove(0, written);
+        if (broken) {
+            backlog.clear();
+            notifier->setEnabled(false);
+        } else if (backlog.isEmpty()) {
+            notifier->setEnabled(false);
+            emit drained();
+        }
+    }
+
+private:
+    // Returns the number of bytes written. Retries short writes until
+    // everything is written or, unless blocking, the pipe is full
+    int writeSome(const char *data, int size, bool blocking) {
+        int done = 0;
+        while (done < size) {
+#ifdef _WIN32
+            int n = _write(1, data + done, unsigned(size - done));
+#else
+            ssize_t n = ::write(1, data + done, size_t(size - done));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!blocking)
+                    break;
+                fd_set fds;
+                FD_ZERO(&fds);
+                FD_SET(1, &fds);
+                select(2, nullptr, &fds, nullptr, nullptr);
+                continue;
+            }
+#endif
+            if (n <= 0) {
+                // EPIPE or EBADF, nobody is listening any more
+                _log_error(Host, "Could not write to stdout: %s", strerror(errno));
+                broken = true;
+                emit closed();
+                return done;
+            }
+            done += int(n);
+        }
+        return done;
+    }
+
+    // Compact JSON, like QJsonDocument::toJson(), without a temporary
+    // document. QVariantMap keeps its keys sorted, as does QJsonObject.
+    static void appendJson(QByteArray &out, const QVariant &value) {
+        switch (int(value.type())) {
+        case QVariant::Map: {
+            const QVariantMap map = value.toMap(); // shared, not copied
+            out += '{';
+            for (auto i = map.constBegin(); i != map.constEnd(); ++i) {
+                if (i != map.constBegin())
+                    out += ',';
+                appendString(out, i.key());
+                out += ':';
+                appendJson(out, i.value());
+            }
+            out += '}';
+            break;
+        }
+        case QVariant::List:
+        case QVariant::StringList: {
+            const QVariantList list = value.toList();
+            out += '[';
+            for (int i = 0; i < list.size(); i++) {
+                if (i)
+                    out += ',';
+                appendJson(out, list.at(i));
+            }
+            out += ']';
+            break;
+        }
+        case QVariant::Invalid:
+            out += "null";
+            break;
+        case QVariant::Bool:
+            out += value.toBool() ? "true" : "false";
+            break;
+        case QVariant::Int:
+        case QVariant::UInt:
+        case QVariant::LongLong:
+            out += QByteArray::number(value.toLongLong());
+            break;
+        case QVariant::ULongLong:
+            out += QByteArray::number(value.toULongLong());
+            break;
+        case QVariant::Double:
+            out += QByteArray::number(value.toDouble(), 'g', 17);
+            break;
+        case QVariant::ByteArray:
+            // Hex and base64, converted as UTF-8 like QJsonValue::fromVariant()
+            appendString(out, QString::fromUtf8(value.toByteArray()));
+            break;
+        default:
+            appendString(out, value.toString());
+        }
+    }
+
+    // Anything but printable ASCII is escaped, as UTF-16 code units
+    static void appendString(QByteArray &out, const QString &text) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (QChar ch: text) {
+            ushort c = ch.unicode();
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += char(c);
+            } else if (c >= 0x20 && c < 0x7f) {
+                out += char(c);
+            } else {
+                const char escape[] = {'\\', 'u', hex[c >> 12], hex[(c >> 8) & 15], hex[(c >> 4) & 15], hex[c & 15]};
+                out.append(escape, sizeof(escape));
+            }
+        }
+        out += '"';
+    }
+
+    QByteArray frame; // reused for every message
+    QByteArray backlog;
+    QSocketNotifier *notifier = nullptr;
+    bool nonblocking = false;
+    bool broken = false; // a write has failed
+};
@@ -19,7 +19,7 @@
 #include "qt_pcsc.h"
 
 #include "Logger.h"
-#include "util.h"
+#include "qt_util.h"
 #include "pcsc.h"
 
 #include <QDialogButtonBox>
@@ -36,7 +36,7 @@ void QtPCSC::reader_selected(const LONG status, const QString &reader, const QSt
     if (status != SCARD_S_SUCCESS) {
         return emit reader_connected(status, reader, protocol, {0});
     }
-    _log("PCSC: using reader %s", reader.toStdString().c_str());
+    _log_pcsc("PCSC: using reader %s", reader.toStdString().c_str());
     LONG err = pcsc.connect(reader.toStdString(), protocol.toStdString());
     // XXX: this should be more logical with a single call to PC/SC
     // If empty at first, wait for insertion, with a dialog
@@ -54,39 +54,45 @@ void QtPCSC::reader_selected(const LONG status, const QString &reader, const QSt
 
 // Process DISCONNECT command
 void QtPCSC::disconnect_reader() {
-    _log("PCSC: disconnecting reader");
+    _log_pcsc("PCSC: disconnecting reader");
     pcsc.disconnect();
-    emit reader_disconnected();
+    emit reader_disconnected(SCARD_S_SUCCESS);
 }
 
-// Reader access cancelled from the "reader in use" dialog
+// Reader access cancelled from the "reader in use" dialog. APDUs that were
+// queued before it have been transmitted, later ones fail.
 void QtPCSC::cancel_reader() {
-    _log("PCSC: cancel reader access");
-    // FIXME: maybe not a good idea, only give a notification with the possibility of removing card?
-    error = SCARD_E_CANCELLED;
+    _log_pcsc("PCSC: cancel reader access");
     pcsc.disconnect();
-    // Note: nothing is emitted here, ongoing APDU is transmitted
-    // and above error returned on next call
+    emit reader_disconnected(SCARD_E_CANCELLED);
 }
 
 // Process CONNECT command
 void QtPCSC::connect_reader(const QString &protocol) {
-    _log("PCSC: connecting to reader");
+    _log_pcsc("PCSC: connecting to reader");
     return emit show_select_reader(protocol);
 }
 
 // Process APDU command
 void QtPCSC::send_apdu(const QByteArray &apdu) {
     std::vector<unsigned char> response;
-    // When the dialog is cancelled, set a local error and use it here for next invocation
-    if (error != SCARD_S_SUCCESS) {
-        emit apdu_sent(error, 0);
-        error = SCARD_S_SUCCESS; // set back to normal
-        return;
-    }
     response.resize(4096); // More than most APDU buffers on cards
-    _log("PCSC: sending APDU: %s", apdu.toHex().toStdString().c_str());
+    _log_at(Logger::Trace, Logger::PCSC, "PCSC: sending APDU: %s", apdu.toHex().toStdString().c_str());
     LONG err = pcsc.transmit(ba2v(apdu), response);
     emit apdu_sent(err, v2ba(response));
 }
 
+// Process APDU batch command
+void QtPCSC::send_apdu_batch(const QByteArrayList &apdus, const QByteArrayList &expected, bool stop) {
+    QByteArrayList responses;
+    std::vector<std::vector<unsigned char>> commands, sws, results;
+    for (const QByteArray &apdu: apdus)
+        commands.push_back(ba2v(apdu));
+    for (const QByteArray &sw: expected)
+        sws.push_back(ba2v(sw));
+    int mismatch;
+    LONG err = pcsc.transmit(commands, sws, stop, results, mismatch);
+    for (const auto &response: results)
+        responses << v2ba(response);
+    emit apdu_batch_sent(err, responses, mismatch);
+}
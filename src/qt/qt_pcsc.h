@@ -25,28 +25,14 @@
 
 #include <vector>
 
-#include "dialogs/insert_card.h"
-#include "dialogs/reader_in_use.h"
-#include "dialogs/select_reader.h"
-
 // Handles PCSC stuff in a dedicated thread.
 class QtPCSC: public QObject {
     Q_OBJECT
 
-public:
-    // Ongoing dialogs of PCSC subsystem
-    QtInsertCard insert_dialog;
-    QtReaderInUse inuse_dialog;
-    QtSelectReader select_dialog;
-
-    QtPCSC() {
-        connect(&this->select_dialog, &QtSelectReader::reader_selected, this, &QtPCSC::reader_selected, Qt::QueuedConnection);
-    }
-
-
 public slots:
     void connect_reader(const QString &protocol);
     void send_apdu(const QByteArray &apdu);
+    void send_apdu_batch(const QByteArrayList &apdus, const QByteArrayList &expected, bool stop);
     void disconnect_reader();
 
     void reader_selected(const LONG status, const QString &reader, const QString &protocol);
@@ -55,12 +41,14 @@ public slots:
 signals:
     void reader_connected(LONG status, const QString &reader, const QString &protocol, const QByteArray &atr);
     void apdu_sent(LONG status, const QByteArray &response);
-    void reader_disconnected();
+    // mismatch is the index of the APDU that stopped the batch, -1 if none
+    void apdu_batch_sent(LONG status, const QByteArrayList &responses, int mismatch);
+    // SCARD_E_CANCELLED if the user took the reader away from the page
+    void reader_disconnected(LONG status);
     void show_insert_card(bool show, const QString &name, const SCARDCONTEXT ctx);
     void show_select_reader(const QString &protocol);
 
 private:
     PCSC pcsc;
-    LONG error = SCARD_S_SUCCESS;
 };
 
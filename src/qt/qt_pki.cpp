@@ -20,8 +20,9 @@
 
 #include "Common.h"
 #include "Logger.h"
-#include "util.h"
+#include "qt_util.h"
 #include "pcsc.h"
+#include "cardprofile.h"
 
 
 #include "modulemap.h"
@@ -35,6 +36,12 @@
 #include <QJsonObject>
 #include <QJsonDocument>
 #include <QJsonArray>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QElapsedTimer>
+
+#include <cstdlib>
+#include <cstring>
 
 
 #ifdef _WIN32
@@ -42,16 +49,70 @@
 #include "WinSigner.h"
 #endif
 
+// The JWS algorithm goes with the key, ES* also with the curve size
+struct JwtAlgorithm {
+    const char *name;
+    QCryptographicHash::Algorithm hash;
+    HashAlgorithm hashalgo;
+};
+
+static JwtAlgorithm jwtAlgorithm(const CertificateInfo &cert) {
+    if (cert.keyType != EcKey)
+        return {"RS256", QCryptographicHash::Sha256, Sha256Hash};
+    if (cert.keyBits <= 256)
+        return {"ES256", QCryptographicHash::Sha256, Sha256Hash};
+    if (cert.keyBits <= 384)
+        return {"ES384", QCryptographicHash::Sha384, Sha384Hash};
+    return {"ES512", QCryptographicHash::Sha512, Sha512Hash};
+}
+
+// Names as in the protocol. Without a name the hash length tells.
+static bool hashAlgorithm(const QString &name, HashAlgorithm &algorithm) {
+    static const QStringList names = {"SHA-1", "SHA-224", "SHA-256", "SHA-384", "SHA-512"};
+    int index = names.indexOf(name.toUpper());
+    algorithm = index < 0 ? UnknownHash : HashAlgorithm(Sha1Hash + index);
+    return index >= 0 || name.isEmpty();
+}
+
 // process SIGN message
 void QtPKI::sign(const QString &origin, const QByteArray &cert, const QByteArray &hash, const QString &hashalgo) {
-    _log("Signing %s:%s", hashalgo.toStdString().c_str(), toHex(ba2v(hash)).c_str());
+    _log_p11("Signing %s:%s", hashalgo.toStdString().c_str(), toHex(ba2v(hash)).c_str());
+    this->origin = origin;
     this->cert = cert;
+    this->fingerprint = CertificateInfo::fingerprintOf(ba2v(cert));
+    this->pkcs11 = module(fingerprint);
     this->hash = hash;
-    this->hashalgo = hashalgo;
     this->purpose = Signing;
+    if (!hashAlgorithm(hashalgo, this->hashalgo)) {
+        _log_warning(P11, "Unknown hash algorithm %s", hashalgo.toStdString().c_str());
+        return finish_signature(CKR_MECHANISM_INVALID, 0);
+    }
     // FIXME: remove origin from signature, available in UI thread, if not needed for windows.
-    _log("PKI: Signing stuff");
-    start_signature(cert, hash, hashalgo, Signing);
+    _log_p11("PKI: Signing stuff");
+    start_signature(cert, hash, this->hashalgo, Signing);
+}
+
+// process signBatch message
+void QtPKI::sign_batch(const QString &origin, const QByteArray &cert, const QByteArrayList &hashes, const QStringList &hashalgos) {
+    _log_p11("Signing a batch of %d hashes", hashes.size());
+    this->origin = origin;
+    this->cert = cert;
+    this->fingerprint = CertificateInfo::fingerprintOf(ba2v(cert));
+    this->pkcs11 = module(fingerprint);
+    this->batch = hashes;
+    this->purpose = Signing;
+    batchalgos.clear();
+    for (const QString &name: hashalgos) {
+        batchalgos.push_back(UnknownHash);
+        if (!hashAlgorithm(name, batchalgos.back())) {
+            _log_warning(P11, "Unknown hash algorithm %s", name.toStdString().c_str());
+            return finish_batch(CKR_MECHANISM_INVALID);
+        }
+    }
+    // Only PKCS#11 tokens can sign a batch
+    if (!pkcs11 || hashes.isEmpty())
+        return finish_batch(hashes.isEmpty() ? CKR_ARGUMENTS_BAD : CKR_KEY_NEEDED);
+    start_signature(cert, QByteArray(), UnknownHash, Signing);
 }
 
 // Called from the PIN dialog to do actual login on pkcs11
@@ -59,50 +120,75 @@ void QtPKI::login(const CK_RV status, const QString &pin, CertificatePurpose pur
     CK_RV result = status;
     // If dialog was canceled, do not login
     if (result != CKR_FUNCTION_CANCELED) {
-        _log("Calling C_Login with %s", pin.toStdString().c_str());
+        _log_p11("Calling C_Login with %s", pkcs11->isPinpad(fingerprint) ? "the pinpad" : "a PIN");
 
-        // This call blocks with a pinpad
-        result = pkcs11.login(ba2v(cert), pin.toStdString().c_str());
+        // This call blocks with a pinpad. The copy is wiped right after.
+        QByteArray utf8 = pin.toUtf8();
+        result = pkcs11->login(fingerprint, utf8.constData(), origin.toStdString(), purpose);
+        utf8.fill(0);
         emit hide_pin_dialog();
     }
 
     if (result == CKR_PIN_INCORRECT) {
         // Show again the pin dialog
-        _log("showing again pin dialog");
-        emit show_pin_dialog(result, *pkcs11.getP11Token(ba2v(cert)), cert, purpose);
+        _log_p11("showing again pin dialog");
+        emit show_pin_dialog(result, *pkcs11->getP11Token(fingerprint), cert, purpose);
     } else {
         pkcs11_sign(result);
     }
 }
 
-// all calls hapepning on this thread
-void QtPKI::start_signature(const QByteArray &cert, const QByteArray &hash, const QString &hashalgo, CertificatePurpose purpose) {
-    const std::vector<unsigned char> crt = ba2v(cert);
+// Called from the dialog that confirms signing with an earlier login
+void QtPKI::confirm(const CK_RV status) {
+    _log_p11("Signing %s", status == CKR_OK ? "confirmed" : "canceled");
+    pkcs11_sign(status);
+}
 
+// all calls hapepning on this thread
+void QtPKI::start_signature(const QByteArray &cert, const QByteArray &hash, HashAlgorithm hashalgo, CertificatePurpose purpose) {
 #ifdef _WIN32
-    if (!pkcs11.getP11Token(crt)) {
+    if (!pkcs11 || !pkcs11->getP11Token(fingerprint)) {
         std::vector<unsigned char> signature;
         // if not in PKCS#11, it must be  Windows cert. We make a blocking call to CryptoAPI
-        CK_RV status = WinSigner::sign(ba2v(hash), crt, signature);
+        CK_RV status = WinSigner::sign(ba2v(hash), ba2v(cert), signature);
         QByteArray qsignature = v2ba(signature);
-        finish_signature(status, qsignature);
+        return finish_signature(status, qsignature);
     }
 #endif
 
-    _log("PKCS#11 signing. Showing PIN dialog");
-    emit show_pin_dialog(CKR_OK, *pkcs11.getP11Token(ba2v(cert)), cert, purpose);
+    if (!pkcs11 || !pkcs11->getP11Token(fingerprint)) {
+        _log_p11("Certificate is not on any loaded token");
+        return finish_signature(CKR_KEY_NEEDED, 0);
+    }
+
+    // A login is only reused for the origin and purpose that it was made for
+    if (!origin.isEmpty() && !pkcs11->needsLogin(fingerprint, origin.toStdString(), purpose)) {
+        // Signing is still confirmed by the user every time
+        if (purpose == Signing) {
+            _log_p11("PKCS#11 signing. Reusing login, asking for confirmation");
+            return emit show_confirm_dialog(*pkcs11->getP11Token(fingerprint), cert);
+        }
+        _log_p11("PKCS#11 signing. Reusing login");
+        return pkcs11_sign(CKR_OK);
+    }
+
+    _log_p11("PKCS#11 signing. Showing PIN dialog");
+    emit show_pin_dialog(CKR_OK, *pkcs11->getP11Token(fingerprint), cert, purpose);
 }
 
 // Login has been successful. Finish ongoing operation
 void QtPKI::pkcs11_sign(const CK_RV status) {
-    _log("Doing C_Sign()");
+    _log_p11("Doing C_Sign()");
+    if (!batch.isEmpty()) {
+        return finish_batch(status);
+    }
     if (status != CKR_OK) {
         return finish_signature(status, 0);
     }
 
     std::vector<unsigned char> signature_vector;
-    CK_RV rv = pkcs11.sign(ba2v(cert), ba2v(hash), signature_vector);
-    _log("PKI: signature: %s %d", toHex(signature_vector).c_str(), purpose);
+    CK_RV rv = pkcs11->sign(fingerprint, ba2v(hash), hashalgo, signature_vector);
+    _log_at(Logger::Trace, Logger::P11, "PKI: signature: %s %d", toHex(signature_vector).c_str(), purpose);
     QByteArray signature = v2ba(signature_vector);
     finish_signature(rv, signature);
 }
@@ -115,14 +201,34 @@ void QtPKI::finish_signature(const CK_RV status, const QByteArray &signature) {
     } else if (purpose == Authentication) {
         // Construct the authentication token.
         // FIXME: check before concat ?
-        QByteArray token = jwt_token + "." + signature.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+        QByteArray jws = jwt_ec_size ? v2ba(ecdsaRaw(ba2v(signature), size_t(jwt_ec_size))) : signature;
+        QByteArray token = jwt_token + "." + jws.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
         return emit authentication_done(status, QString(token));
     }
 }
 
+// Signs the batch, streaming out the signatures one by one
+void QtPKI::finish_batch(const CK_RV status) {
+    CK_RV rv = status;
+    int count = 0;
+    if (rv == CKR_OK) {
+        std::vector<std::vector<unsigned char>> hashes;
+        hashes.reserve(batch.size());
+        for (const QByteArray &hash: batch)
+            hashes.push_back(ba2v(hash));
+        rv = pkcs11->signMany(fingerprint, hashes, batchalgos, [&](size_t index, const std::vector<unsigned char> &signature) {
+            count++;
+            emit sign_batch_progress(int(index), v2ba(signature));
+        });
+    }
+    _log_p11("Signed %d of %d hashes: %s", count, batch.size(), errorName(rv));
+    clear();
+    emit sign_batch_done(rv, count);
+}
+
 // process AUTH message
 void QtPKI::authenticate(const QString &origin, const QString &nonce) {
-    _log("PKI: Authenticating");
+    _log_p11("PKI: Authenticating");
     this->origin = origin;
     this->nonce = nonce;
     // Get certificate // FIXME: silent handling
@@ -135,11 +241,18 @@ void QtPKI::authenticate_with(const CK_RV status, const QByteArray &cert) {
         return emit authentication_done(status, QString());
     }
 
-    // Construct dtbs
-    jwt_token = authenticate_dtbs(QSslCertificate(cert, QSsl::Der), origin, nonce);
+    // Construct dtbs, certificates from elsewhere than PKCS#11 are parsed here
+    const CertificateInfo *info = pkcs11 ? pkcs11->getCertInfo(fingerprint) : nullptr;
+    CertificateInfo parsed = info ? CertificateInfo() : CertificateInfo::parse(ba2v(cert));
+    if (!info)
+        info = &parsed;
+    jwt_token = authenticate_dtbs(*info, origin, nonce);
+    jwt_ec_size = info->keyType == EcKey ? (info->keyBits + 7) / 8 : 0;
 
     // Calculate hash
-    hash = QCryptographicHash::hash(jwt_token, QCryptographicHash::Sha256);
+    JwtAlgorithm algorithm = jwtAlgorithm(*info);
+    hash = QCryptographicHash::hash(jwt_token, algorithm.hash);
+    hashalgo = algorithm.hashalgo;
 
     // Sign the hash
     start_signature(cert, hash, hashalgo, Authentication);
@@ -148,15 +261,14 @@ void QtPKI::authenticate_with(const CK_RV status, const QByteArray &cert) {
 // Selects a certificate for the PKI context.
 // Called from web or internally (for authenticate)
 void QtPKI::select_certificate(const QString &origin, CertificatePurpose purpose, bool silent) {
-    _log("PKI: selecting certificate");
+    _log_p11("PKI: selecting certificate");
 
     // FIXME: single place where this happens
-    std::vector<std::vector<unsigned char>> atrs = PCSC::atrList();
-    std::vector<std::string> modules = P11Modules::getPaths(atrs);
+    scan(false);
 
     std::vector<unsigned char> cert;
 
-    if (modules.empty()) {
+    if (this->modules.loaded().empty() && direct.empty()) {
 #ifdef _WIN32
         // No PKCS#11 modules detected for any of the connected cards.
         // Check if we can find a cert from certstore
@@ -166,11 +278,18 @@ void QtPKI::select_certificate(const QString &origin, CertificatePurpose purpose
 #endif
         cert_selected(CKR_KEY_NEEDED, 0, purpose);
     } else {
-        // FIXME: only one module currently
-        pkcs11.load(modules[0]);
-        std::vector<std::vector<unsigned char>> certs = pkcs11.getCerts(purpose);
+        std::vector<CertificateInfo> certs;
+        for (const auto &info: direct) {
+            if (info->usableFor(purpose))
+                certs.push_back(*info);
+        }
+        for (const CertificateInfo &info: this->modules.getCerts(purpose)) {
+            // A module may see a card that was read directly as well
+            if (std::none_of(certs.cbegin(), certs.cend(), [&](const CertificateInfo &c) { return c.fingerprint == info.fingerprint; }))
+                certs.push_back(info);
+        }
         if (certs.size() == 1 && silent) {
-            return cert_selected(CKR_OK, v2ba(certs[0]), purpose);
+            return cert_selected(CKR_OK, v2ba(certs[0].der), purpose);
         }
         if (certs.empty()) {
             // TODO: what return code to use ?
@@ -183,8 +302,11 @@ void QtPKI::select_certificate(const QString &origin, CertificatePurpose purpose
 }
 
 void QtPKI::cert_selected(const CK_RV status, const QByteArray &cert, CertificatePurpose purpose) {
-    _log("Certificate was selected %s", errorName(status));
+    _log_p11("Certificate was selected %s", errorName(status));
     this->cert = cert;
+    this->fingerprint = CertificateInfo::fingerprintOf(ba2v(cert));
+    // Modules are only loaded for a signature, which is right away for authentication
+    this->pkcs11 = purpose == Authentication ? module(fingerprint) : modules.find(fingerprint);
     this->purpose = purpose;
     // FIXME: calling from sign()
     if (purpose == Signing) {
@@ -196,47 +318,103 @@ void QtPKI::cert_selected(const CK_RV status, const QByteArray &cert, Certificat
     }
 }
 
+// Cards that have not been removed or replaced since. pcsc-lite and
+// WinSCard count the card events of a reader in the upper word of its state.
+static bool sameCards(const std::vector<PCSCReader> &a, const std::vector<PCSCReader> &b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const PCSCReader &x, const PCSCReader &y) {
+        return x.name == y.name && x.atr == y.atr && (x.state.dwEventState >> 16) == (y.state.dwEventState >> 16);
+    });
+}
+
+// Known cards are read directly, modules are loaded for the others, or
+// for all cards if asked. Cards are not read again until they change,
+// loaded modules only look for slot events.
+void QtPKI::scan(bool all) {
+    std::vector<PCSCReader> readers = PCSC::readerList();
+    if (scanned && sameCards(readers, scanned_readers)) {
+        _log_p11("Cards have not changed, using the last scan");
+    } else {
+        std::vector<std::vector<unsigned char>> atrs;
+        direct = CardProfile::readAll(readers, atrs);
+        if (all) {
+            atrs.clear();
+            for (const PCSCReader &reader: readers) {
+                if (!reader.atr.empty())
+                    atrs.push_back(reader.atr);
+            }
+        }
+        scanned_modules = P11Modules::getPaths(atrs);
+        scanned_readers = readers;
+        scanned = true;
+    }
+    // All matching modules and their tokens are read concurrently
+    modules.load(scanned_modules, PCSC::generation());
+}
+
+// Runs on this thread before the first request, which is queued behind it
+// and finds the cards read and the modules initialized. WEB_EID_PREWARM=0
+// leaves everything to the first request.
+void QtPKI::prewarm() {
+    const char *env = getenv("WEB_EID_PREWARM");
+    if (env && strcmp(env, "0") == 0)
+        return;
+    QElapsedTimer timer;
+    timer.start();
+    scan(true);
+    _log_p11("Prewarmed %u modules in %lld ms", unsigned(modules.loaded().size()), timer.elapsed());
+}
+
+// Certificates read directly off a card need the modules to be loaded
+// now. Otherwise they are from the last selection.
+PKCS11Module *QtPKI::module(const Fingerprint &fingerprint) {
+    PKCS11Module *found = modules.find(fingerprint);
+    if (!found && std::any_of(direct.cbegin(), direct.cend(), [&](const std::shared_ptr<const CertificateInfo> &info) { return info->fingerprint == fingerprint; })) {
+        _log_p11("Loading modules for a certificate that was read directly");
+        modules.load(P11Modules::getPaths(PCSC::atrList()), PCSC::generation());
+        found = modules.find(fingerprint);
+    }
+    return found;
+}
+
 // FIXME: move to pkcs11module.h
 const char *QtPKI::errorName(const CK_RV err) {
     return PKCS11Module::errorName(err);
 }
 
 // static
-QByteArray QtPKI::authenticate_dtbs(const QSslCertificate &cert, const QString &origin, const QString &nonce) {
+QByteArray QtPKI::authenticate_dtbs(const CertificateInfo &cert, const QString &origin, const QString &nonce) {
     QByteArray dtbs;
     // Construct the data to be signed
-    auto subject = cert.subjectInfo(QSslCertificate::CommonName);
-    auto issuer = cert.issuerInfo(QSslCertificate::CommonName);
-    if (subject.size() < 1 || issuer.size() < 1) {
-        _log("No CN for subject or issuer!");
+    if (cert.subjectCN.empty() || cert.issuerCN.empty()) {
+        _log_p11("No CN for subject or issuer!");
         return dtbs;
     }
-    _log("Constructing JWT for %s", subject.at(0).toStdString().c_str());
+    _log_p11("Constructing JWT for %s", cert.subjectCN.c_str());
 
     // Header
     QJsonDocument header_map({
-        {"alg", "RS256"}, // TODO: ES256 as well
+        {"alg", jwtAlgorithm(cert).name},
         {"typ", "JWT"},
         // XXX: Qt 5.5 fails with the following, x5c will be null
-        {"x5c", QJsonArray({ QString(cert.toDer().toBase64()) })},
+        {"x5c", QJsonArray({ QString(v2ba(cert.der).toBase64()) })},
     });
     QByteArray header_json = header_map.toJson(QJsonDocument::Compact);
     QByteArray header = header_json.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
-    _log("JWT header: %s", header_map.toJson().toStdString().c_str());
+    _log_at(Logger::Trace, Logger::P11, "JWT header: %s", header_map.toJson().toStdString().c_str());
 
     // Payload
     QJsonDocument payload_map({
         {"exp", int(QDateTime::currentDateTimeUtc().toTime_t() + 5*60)}, // TODO: TBS, expires in 5 minutes
         {"iat", int(QDateTime::currentDateTimeUtc().toTime_t())},
         {"aud", origin},
-        {"iss", issuer.at(0)}, // TODO: TBS
-        {"sub", subject.at(0)}, // TODO: TBS
+        {"iss", QString::fromStdString(cert.issuerCN)}, // TODO: TBS
+        {"sub", QString::fromStdString(cert.subjectCN)}, // TODO: TBS
         {"nonce", nonce},
     });
 
     QByteArray payload_json = payload_map.toJson(QJsonDocument::Compact);
     QByteArray payload = payload_json.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
-    _log("JWT payload: %s", payload_map.toJson().toStdString().c_str());
+    _log_at(Logger::Trace, Logger::P11, "JWT payload: %s", payload_map.toJson().toStdString().c_str());
 
     // calculate DTBS (Data To Be Signed)
     dtbs = header + "." + payload;
@@ -19,54 +19,66 @@
 #pragma once
 
 #include <QObject>
+#include <QByteArrayList>
+#include <QStringList>
 
 #include "pkcs11module.h"
+#include "pcsc.h"
 
-#include "dialogs/select_cert.h"
-#include "dialogs/pin.h"
-
+#include <algorithm>
+#include <string>
 #include <vector>
 
 class QtPKI: public QObject {
     Q_OBJECT
 
 public:
-    QtCertSelect select_dialog;
-    QtPINDialog pin_dialog;
-
     static const char *errorName(const CK_RV err);
 public slots:
     void authenticate(const QString &origin, const QString &nonce);
     void sign(const QString &origin, const QByteArray &cert, const QByteArray &hash, const QString &hashalgo);
+    void sign_batch(const QString &origin, const QByteArray &cert, const QByteArrayList &hashes, const QStringList &hashalgos);
     void select_certificate(const QString &origin, CertificatePurpose purpose, bool silent);
+    // Reads the cards and loads their modules ahead of the first request
+    void prewarm();
 
     void cert_selected(const CK_RV status, const QByteArray &cert, CertificatePurpose purpose);
 
 
     void login(const CK_RV status, const QString &pin, CertificatePurpose purpose);
     void pkcs11_sign(const CK_RV status);
+    // Called from the confirmation dialog when a login is reused
+    void confirm(const CK_RV status);
 
 private:
     void authenticate_with(const CK_RV status, const QByteArray &cert);
 
-    void start_signature(const QByteArray &cert, const QByteArray &hash, const QString &hashalgo, CertificatePurpose purpose);
+    void start_signature(const QByteArray &cert, const QByteArray &hash, HashAlgorithm hashalgo, CertificatePurpose purpose);
     void finish_signature(const CK_RV status, const QByteArray &signature);
+    void finish_batch(const CK_RV status);
 
 
 signals:
     void sign_done(const CK_RV status, const QByteArray &signature);
+    // One for every signature of a batch, then sign_batch_done
+    void sign_batch_progress(int index, const QByteArray &signature);
+    void sign_batch_done(const CK_RV status, int count);
     void authentication_done(const CK_RV status, const QString &token);
     void select_certificate_done(const CK_RV status, const QByteArray &certificate);
 
-    void show_cert_select(const QString origin, std::vector<std::vector<unsigned char>> certs, CertificatePurpose purpose);
+    void show_cert_select(const QString origin, std::vector<CertificateInfo> certs, CertificatePurpose purpose);
     void show_pin_dialog(const CK_RV last, P11Token token, const QByteArray &cert, CertificatePurpose purpose);
     void hide_pin_dialog();
+    void show_confirm_dialog(P11Token token, const QByteArray &cert);
 
 public:
     void clear() {
         cert.clear();
+        fingerprint = Fingerprint();
         hash.clear();
-        hashalgo.clear();
+        batch.clear();
+        batchalgos.clear();
+        hashalgo = UnknownHash;
         origin.clear();
         nonce.clear();
         purpose = UnknownPurpose;
@@ -74,17 +86,32 @@ public:
 
 private:
     // Valid for whole session
-    PKCS11Module pkcs11;
-
-    static QByteArray authenticate_dtbs(const QSslCertificate &cert, const QString &origin, const QString &nonce);
+    PKCS11Registry modules;
+    // The module that has the certificate in use
+    PKCS11Module *pkcs11 = nullptr;
+    // Certificates of the last scan that were read without a module
+    std::vector<std::shared_ptr<const CertificateInfo>> direct;
+    PKCS11Module *module(const Fingerprint &fingerprint);
+    // The readers and cards as of the last scan
+    std::vector<PCSCReader> scanned_readers;
+    std::vector<std::string> scanned_modules; // loaded again on every scan
+    bool scanned = false;
+    void scan(bool all);
+
+    static QByteArray authenticate_dtbs(const CertificateInfo &cert, const QString &origin, const QString &nonce);
 
     // Valid for a single transaction
     QByteArray cert;
+    Fingerprint fingerprint; // of cert
     QByteArray hash;
-    QString hashalgo; // FIXME: enum
+    HashAlgorithm hashalgo = UnknownHash;
+    // Batch signing
+    QByteArrayList batch;
+    std::vector<HashAlgorithm> batchalgos;
     CertificatePurpose purpose;
     // Authentication
     QString origin;
     QString nonce;
     QByteArray jwt_token;
+    int jwt_ec_size = 0; // bytes of r and s in an ES* signature, 0 for RS256
 };
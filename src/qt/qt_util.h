@@ -0,0 +1,42 @@
+/*
+ * Chrome Token Signing Native Host
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#pragma once
+// silence the warnings for now TODO
+#ifdef __clang__
+#pragma clang system_header
+#endif
+#ifdef __GNUC__
+#pragma GCC system_header
+#endif
+
+#include "util.h"
+
+#include <QByteArray>
+
+#include <string>
+#include <vector>
+
+static const std::vector<unsigned char> ba2v(const QByteArray &data) {
+    return std::vector<unsigned char>(data.cbegin(), data.cend());
+}
+
+static const QByteArray v2ba(const std::vector<unsigned char> &data) {
+    return QByteArray((const char*)data.data(), int(data.size()));
+}
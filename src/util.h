@@ -25,24 +25,22 @@
 #pragma GCC system_header
 #endif
 
+#include <algorithm>
+#include <cstdio>
+#include <string>
 #include <vector>
-#include <QSslCertificate>
 #include <stdexcept>
 
-static const std::vector<unsigned char> ba2v(const QByteArray &data) {
-    return std::vector<unsigned char>(data.cbegin(), data.cend());
-}
-
-static const QByteArray v2ba(const std::vector<unsigned char> &data) {
-    return QByteArray((const char*)data.data(), int(data.size()));
-}
-
-static const QSslCertificate v2cert(const std::vector<unsigned char> &data) {
-    return QSslCertificate(QByteArray::fromRawData((const char*)data.data(), int(data.size())), QSsl::Der);
-}
+// Helpers of the core, without Qt. See qt/qt_util.h for the Qt ones.
 
 static const std::string toHex(const std::vector<unsigned char> &data) {
-    return QByteArray::fromRawData((const char*)data.data(), int(data.size())).toHex().toStdString();
+    static const char digits[] = "0123456789abcdef";
+    std::string result(data.size() * 2, 0);
+    for (size_t i = 0; i < data.size(); i++) {
+        result[2 * i] = digits[data[i] >> 4];
+        result[2 * i + 1] = digits[data[i] & 0x0f];
+    }
+    return result;
 }
 
 static const std::vector<unsigned char> hex2v(const std::string &hex) {
@@ -62,17 +60,28 @@ static const std::vector<unsigned char> hex2v(const std::string &hex) {
     return bin;
 }
 
-static const std::string x509subject(const std::vector<unsigned char> &c) {
-    QSslCertificate cert(QByteArray::fromRawData((const char *)c.data(), int(c.size())), QSsl::Der);
-    std::string result;
-    QList<QString> cn = cert.subjectInfo(QSslCertificate::CommonName);
-    if (cn.size() > 0)
-        result.append(cn.at(0).toStdString());
-
-    QList<QString> ou = cert.subjectInfo(QSslCertificate::OrganizationalUnitName);
-    if (ou.size() > 0) {
-        result.append(" ");
-        result.append(ou.at(0).toStdString());
+// ECDSA signature as r and s of size bytes each, which is what JWS wants.
+// Some providers return the DER encoded SEQUENCE of two INTEGERs instead.
+static const std::vector<unsigned char> ecdsaRaw(const std::vector<unsigned char> &signature, size_t size) {
+    if (signature.size() == 2 * size || signature.size() < 8 || signature[0] != 0x30)
+        return signature;
+    std::vector<unsigned char> raw(2 * size, 0);
+    size_t pos = signature[1] == 0x81 ? 3 : 2;
+    for (size_t i = 0; i < 2; i++) {
+        if (pos + 2 > signature.size() || signature[pos] != 0x02)
+            return signature;
+        size_t length = signature[pos + 1];
+        pos += 2;
+        if (pos + length > signature.size())
+            return signature;
+        // INTEGERs have a leading zero if the high bit is set
+        size_t skip = 0;
+        while (length - skip > size && signature[pos + skip] == 0)
+            skip++;
+        if (length - skip > size)
+            return signature;
+        std::copy(signature.begin() + pos + skip, signature.begin() + pos + length, raw.begin() + (i + 1) * size - (length - skip));
+        pos += length;
     }
-    return result;
+    return raw;
 }
@@ -11,22 +11,15 @@ isEmpty(VERSION) {
 CONFIG += console c++11
 QT += widgets network
 RC_ICONS = ../artwork/win_icon.ico
+include(core.pri)
 macx {
-    LIBS += -framework PCSC
     QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
     QMAKE_INFO_PLIST += Info.plist
     CONFIG += app_bundle
 }
-unix:!macx: {
-    PKGCONFIG += libpcsclite
-    CONFIG += link_pkgconfig
-}
-unix {
-    LIBS += -ldl
-}
 win32 {
     DEFINES += WIN32_LEAN_AND_MEAN
-    LIBS += winscard.lib ncrypt.lib crypt32.lib cryptui.lib Advapi32.lib
+    LIBS += ncrypt.lib crypt32.lib cryptui.lib Advapi32.lib
     SOURCES += win/WinCertSelect.cpp win/WinSigner.cpp
     HEADERS += win/WinCertSelect.h win/WinSigner.h
     INCLUDEPATH += win
@@ -34,10 +27,8 @@ win32 {
 }
 DEFINES += VERSION=\\\"$$VERSION\\\"
 SOURCES += \
-    Logger.cpp \
-    modulemap.cpp \
-    pcsc.cpp \
-    pkcs11module.cpp \
+    $$CORE_SOURCES \
+    broker.cpp \
     qt/chrome-host.cpp \
     qt/qt_pcsc.cpp \
     qt/qt_pki.cpp
@@ -18,7 +18,7 @@
 
 #include "WinCertSelect.h"
 
-#include "util.h"
+#include "der.h"
 #include "Logger.h"
 
 #include <Windows.h>
@@ -195,7 +195,7 @@ CK_RV WinCertSelect::getCert(CertificatePurpose p, LPCWSTR message, std::vector<
     }
     std::vector<unsigned char> cert(cert_context->pbCertEncoded, cert_context->pbCertEncoded + cert_context->cbCertEncoded);
     result = cert;
-    _log("Selected certificate with subject %s", x509subject(result).c_str()); // XXX: requires OpenSSL dll-s with Qt
+    _log("Selected certificate with subject %s", x509subject(result).c_str());
     CertFreeCertificateContext(cert_context);
     CertCloseStore(store, 0);
     return CKR_OK;
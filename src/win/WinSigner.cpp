@@ -93,10 +93,16 @@ CK_RV WinSigner::sign(const std::vector<unsigned char> &hash, const std::vector<
     {
     case CERT_NCRYPT_KEY_SPEC:
     {
-        err = NCryptSignHash(key, &padInfo, PBYTE(hash.data()), DWORD(hash.size()), result.data(), DWORD(result.size()), (DWORD*)&size, BCRYPT_PAD_PKCS1);
+        // ECDSA keys take the bare hash
+        WCHAR group[32] = {};
+        DWORD groupSize = 0;
+        bool ec = NCryptGetProperty(key, NCRYPT_ALGORITHM_GROUP_PROPERTY, PBYTE(group), sizeof(group), &groupSize, 0) == ERROR_SUCCESS
+            && wcscmp(group, NCRYPT_ECDSA_ALGORITHM_GROUP) == 0;
+        err = NCryptSignHash(key, ec ? nullptr : &padInfo, PBYTE(hash.data()), DWORD(hash.size()), result.data(), DWORD(result.size()), (DWORD*)&size, ec ? 0 : BCRYPT_PAD_PKCS1);
         if (freeKeyHandle) {
             NCryptFreeObject(key);
         }
+        result.resize(size);
         break;
     }
     case AT_SIGNATURE:
@@ -40,6 +40,11 @@ class TestAuth(ChromeTest):
       payload = json.loads(base64.urlsafe_b64decode(b64pad(c[1])))
       self.assertEquals(payload["aud"], "https://example.com")
       self.assertEquals(payload["nonce"], nonce)
+      # ES* signatures are r and s back to back, not DER
+      sizes = {"RS256": None, "ES256": 64, "ES384": 96, "ES512": 132}
+      self.assertIn(header["alg"], sizes)
+      if sizes[header["alg"]]:
+          self.assertEquals(len(base64.urlsafe_b64decode(b64pad(c[2]))), sizes[header["alg"]])
       print json.dumps(header, indent = 4)
       print json.dumps(payload, indent = 4)
 
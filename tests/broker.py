@@ -0,0 +1,68 @@
+#
+# Chrome Token Signing Native Host
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import unittest
+import uuid
+import testconf
+from chrome import ChromeTest
+
+# Pages are served by a shared broker with WEB_EID_BROKER=1. Every test
+# has a broker of its own, in a runtime directory of its own.
+class TestBroker(ChromeTest):
+
+  def start(self):
+      env = dict(os.environ, WEB_EID_BROKER="1", WEB_EID_BROKER_IDLE="1", XDG_RUNTIME_DIR=self.runtime)
+      return subprocess.Popen([testconf.get_exe(), "chrome-extension://fmpfihjoladdfajbnkdfocnbcehjpogi"], stdin=subprocess.PIPE, stdout=subprocess.PIPE, close_fds=not sys.platform.startswith('win32'), env=env)
+
+  def setUp(self):
+      self.runtime = tempfile.mkdtemp()
+      self.p = self.start()
+      self.pages = [self.p]
+
+  def tearDown(self):
+      for page in self.pages:
+          if page.poll() == None:
+              page.terminate()
+      # The broker writes its PID to the lock file
+      try:
+          with open(os.path.join(self.runtime, "web-eid", "broker.lock")) as lock:
+              os.kill(int(lock.read()), signal.SIGTERM)
+      except (IOError, OSError, ValueError):
+          pass
+      shutil.rmtree(self.runtime, ignore_errors=True)
+
+  def test_two_pages(self):
+      first = self.p
+      self.transact({"version": {}})
+      self.p = self.start()
+      self.pages.append(self.p)
+      self.transact({"version": {}, "origin": "https://example.org"})
+      # Origins are kept apart
+      self.p = first
+      resp = self.transceive({"version": {}, "id": str(uuid.uuid4()), "origin": "https://example.org"})
+      self.assertEqual(resp["error"], "protocol")
+      self.assertEqual(self.p.wait(), 1)
+
+if __name__ == '__main__':
+    unittest.main()
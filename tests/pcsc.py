@@ -31,6 +31,29 @@ class TestPCSC(ChromeTest):
       cmd = {"SCardDisconnect": {}, "origin": "https://example.com/"}
       resp = self.transact(cmd)
 
+  def test_pcsc_batch(self):
+      cmd = {"SCardConnect": {"protocol": "*"}, "origin": "https://example.com/"}
+      resp = self.transact(cmd)
+      apdus = [{"bytes": "00a4000400"}, {"bytes": "00a4000400", "sw": "9000"}, {"bytes": "00a4000400"}]
+      cmd = {"SCardTransmitBatch": {"apdus": apdus, "stopOnMismatch": False}, "origin": "https://example.com/"}
+      resp = self.transact(cmd)
+      self.assertEqual(len(resp["responses"]), len(apdus))
+      cmd = {"SCardDisconnect": {}, "origin": "https://example.com/"}
+      resp = self.transact(cmd)
+
+  def test_pcsc_batch_mismatch(self):
+      cmd = {"SCardConnect": {"protocol": "*"}, "origin": "https://example.com/"}
+      resp = self.transact(cmd)
+      # No card knows INS FF, the batch stops at the second APDU
+      apdus = [{"bytes": "00a4000400"}, {"bytes": "00ff000000", "sw": "9000"}, {"bytes": "00a4000400"}]
+      cmd = {"SCardTransmitBatch": {"apdus": apdus, "stopOnMismatch": True}, "origin": "https://example.com/"}
+      resp = self.transact(cmd)
+      self.assertEqual(len(resp["responses"]), 2)
+      self.assertEqual(resp["mismatch"], 1)
+      self.assertFalse(resp["responses"][1].endswith("9000"))
+      cmd = {"SCardDisconnect": {}, "origin": "https://example.com/"}
+      resp = self.transact(cmd)
+
   def test_pcsc_card_removal(self):
      self.instruct("Select a reader, insert card, remove during apdu-s")
      cmd = {"SCardConnect": {"protocol": "*"}, "origin": "https://example.com/"}
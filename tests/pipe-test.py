@@ -60,6 +60,18 @@ class TestHostPipe(ChromeTest):
       self.assertEquals(resp["error"], "protocol")
       self.assertEqual(self.p.wait(), 1)
 
+  def test_pipelined_version(self):
+      # Requests are answered with their own id, without waiting for the previous one
+      ids = ["first", "second"]
+      for i in ids:
+        msg = json.dumps({"id": i, "origin": "https://example.com", "version": {}})
+        self.p.stdin.write(struct.pack("=I", len(msg)))
+        self.p.stdin.write(bytearray(msg, 'utf-8'))
+      for i in ids:
+        resp = self.get_response()
+        self.assertEquals(resp["id"], i)
+        self.assertTrue(re.compile(version_re).match(resp["version"]))
+
 #  def test_length_exceeds_data(self):
 #      # write length > data size
 #      self.p.stdin.write(struct.pack("=I", 0x0000000F))
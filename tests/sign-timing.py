@@ -0,0 +1,82 @@
+#
+# Chrome Token Signing Native Host
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# Times batch signing with hwcrypto-cli on a SoftHSM token, on a single
+# session and on as many as the module allows:
+#
+#   SOFTHSM=/usr/lib/softhsm/libsofthsm2.so python3 tests/sign-timing.py [COUNT...]
+#
+# CLI selects hwcrypto-cli, src/cli/hwcrypto-cli by default. Needs
+# softhsm2-util, pkcs11-tool from OpenSC and openssl.
+
+import binascii
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+PIN = "1234"
+
+def run(args, env, stdin=None):
+    p = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE, env=env)
+    out, _ = p.communicate(stdin)
+    if p.returncode != 0:
+        sys.exit("%s failed with %d" % (args[0], p.returncode))
+    return out.decode()
+
+# A token with one P-256 key and a certificate for it
+def token(module, directory, env):
+    with open(os.path.join(directory, "softhsm2.conf"), "w") as conf:
+        conf.write("directories.tokendir = %s\nobjectstore.backend = file\n" % directory)
+    env["SOFTHSM2_CONF"] = conf.name
+    run(["softhsm2-util", "--init-token", "--free", "--label", "web-eid", "--pin", PIN, "--so-pin", PIN + PIN], env)
+    key, cert = os.path.join(directory, "key"), os.path.join(directory, "cert")
+    run(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:P-256", "-nodes", "-days", "1",
+         "-subj", "/CN=Timing", "-addext", "keyUsage=critical,nonRepudiation", "-keyout", key + ".pem", "-out", cert + ".pem"], env)
+    run(["openssl", "pkcs8", "-topk8", "-nocrypt", "-in", key + ".pem", "-outform", "DER", "-out", key + ".der"], env)
+    run(["openssl", "x509", "-in", cert + ".pem", "-outform", "DER", "-out", cert + ".der"], env)
+    for path, kind in ((key + ".der", "privkey"), (cert + ".der", "cert")):
+        run(["pkcs11-tool", "--module", module, "--login", "--pin", PIN, "--write-object", path, "--type", kind, "--id", "01"], env)
+
+def main():
+    module = os.environ.get("SOFTHSM", "/usr/lib/softhsm/libsofthsm2.so")
+    cli = os.environ.get("CLI", "src/cli/hwcrypto-cli")
+    counts = [int(arg) for arg in sys.argv[1:]] or [1, 10, 100]
+    directory = tempfile.mkdtemp()
+    env = dict(os.environ, WEB_EID_PIN=PIN, WEB_EID_CERT_CACHE="0")
+    try:
+        token(module, directory, env)
+        fingerprint = run([cli, "-m", module, "certs"], env).split("\t")[0]
+        print("%8s %8s %10s %10s" % ("hashes", "sessions", "total ms", "ms/hash"))
+        for count in counts:
+            hashes = "".join(binascii.hexlify(os.urandom(32)).decode() + "\n" for _ in range(count)).encode()
+            for workers in ("1", "8"):
+                env["WEB_EID_SIGN_WORKERS"] = workers
+                start = time.time()
+                signatures = run([cli, "-m", module, "sign", fingerprint, "SHA-256"], env, hashes).split()
+                elapsed = (time.time() - start) * 1000
+                if len(signatures) != count:
+                    sys.exit("Expected %d signatures, got %d" % (count, len(signatures)))
+                print("%8d %8s %10.1f %10.2f" % (count, workers, elapsed, elapsed / count))
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+if __name__ == '__main__':
+    main()
@@ -16,6 +16,7 @@
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #
 
+import os
 import unittest
 import uuid
 import base64
@@ -33,6 +34,31 @@ class TestSigning(ChromeTest):
       cmd = {"sign": {"cert": resp["cert"], "hash": base64.b64encode(binascii.unhexlify("2CADA1A6A22AA2A9BF9093281DC6C42D46142F9CABDFA490658A84677E4AA40E")), "hashalgo": "SHA-256"}}
       resp = self.transact(cmd)
 
+  def test_sign_unknown_hashalgo(self):
+      cmd = {"cert": {}}
+      resp = self.transact(cmd)
+      self.assertEqual("cert" in resp, True)
+      cmd = {"sign": {"cert": resp["cert"], "hash": base64.b64encode(os.urandom(32)).decode(), "hashalgo": "SHA3-256"}}
+      resp = self.transact(cmd)
+      self.assertEqual(resp["error"], "CKR_MECHANISM_INVALID")
+
+  def test_sign_batch(self):
+      cmd = {"cert": {}}
+      resp = self.transact(cmd)
+      self.assertEqual("cert" in resp, True)
+      hashes = [{"hash": base64.b64encode(os.urandom(32)).decode(), "hashalgo": "SHA-256"} for i in range(3)]
+      cmd = {"id": str(uuid.uuid4()), "origin": "https://example.com", "signBatch": {"cert": resp["cert"], "hashes": hashes}}
+      # one frame per signature, then the summary
+      resp = self.transceive(cmd)
+      for i in range(3):
+          self.assertEqual(resp["id"], cmd["id"])
+          self.assertEqual(resp["index"], i)
+          base64.b64decode(resp["signature"])
+          resp = self.get_response()
+      self.assertEqual(resp["id"], cmd["id"])
+      self.assertEqual(resp["signed"], 3)
+      self.assertEqual("error" in resp, False)
+
 
 if __name__ == '__main__':
     # run tests
@@ -6,7 +6,7 @@ Summary:        Use your eID card on the Web
 License:        LGPLv2+
 URL:            https://web-eid.com
 
-BuildRequires:  qt5-qtbase-devel qt5-linguist pcsc-lite-devel
+BuildRequires:  qt5-qtbase-devel qt5-linguist pcsc-lite-devel openssl-devel
 Requires:       pcsc-lite opensc
 
 %description